@@ -1,12 +1,27 @@
 #pragma once
 
+#include <cstdio>
+#include <cstring>
+#include <memory>
 #include <stdexcept>
+#include <string>
 #include <tuple>
+#include <type_traits>
+
+#if __cplusplus >= 201703L
+#include <optional>
+#include <string_view>
+#include <variant>
+#define GLUA_STRING_VIEW 1
+#define GLUA_VARIANT 1
+#endif
 
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+#include "compat.hpp"
+#include "error.hpp"
 #include "util.hpp"
 
 /**
@@ -24,6 +39,89 @@
 namespace glua {
 namespace api {
 
+namespace detail {
+/**
+ * Address used as the registry key under which the metatable of
+ * type T is cached, so type checks can use lua_rawgetp instead of
+ * a string-keyed lookup. Function-local statics of inline functions
+ * are unique across translation units.
+ */
+template<typename T>
+inline const void* _type_key() {
+    static const char key = 0;
+    return &key;
+}
+
+/**
+ * Userdata of type T* either hold a plain pointer, or a pointer
+ * followed by an owning smart pointer and the function which
+ * destroys it. The pointer always comes first, so reading a T from
+ * any of them is the same single load.
+ */
+template<typename T>
+struct _ptr_header {
+    T* ptr;
+    void (*destroy)(void*);
+};
+
+template<typename T, typename Owner>
+struct _ptr_holder {
+    _ptr_header<T> header;
+    Owner owner;
+};
+
+template<typename T, typename Owner>
+inline void _destroy_holder(void* p) {
+    static_cast<_ptr_holder<T, Owner>*>(p)->owner.~Owner();
+}
+
+/**
+ * __gc of T* userdata; plain pointers are smaller than the header
+ * and are left alone.
+ */
+template<typename T>
+inline int _ptr_gc(lua_State* l) {
+    if(lua_rawlen(l, 1) < sizeof(_ptr_header<T>)) return 0;
+    _ptr_header<T>* h = static_cast<_ptr_header<T>*>(lua_touserdata(l, 1));
+    if(h->destroy != nullptr) {
+        void (*destroy)(void*) = h->destroy;
+        h->ptr = nullptr;
+        h->destroy = nullptr;
+        destroy(h);
+    }
+    return 0;
+}
+
+/**
+ * Fills in a newly created metatable for userdata of type T.
+ */
+template<typename T>
+struct _init_metatable {
+    inline static void init(lua_State&) {}
+};
+
+template<typename T>
+struct _init_metatable<T*> {
+    inline static void init(lua_State& l) {
+        lua_pushcfunction(&l, &_ptr_gc<T>);
+        lua_setfield(&l, -2, "__gc");
+    }
+};
+
+/**
+ * Set the metatable of type T on the userdata on top of the stack.
+ */
+template<typename T>
+inline void _set_type_metatable(lua_State& l) {
+    if(luaL_newmetatable(&l, ::glua::detail::type_traits<T>::name)) {
+        _init_metatable<T>::init(l);
+        lua_pushvalue(&l, -1);
+        lua_rawsetp(&l, LUA_REGISTRYINDEX, _type_key<T>());
+    }
+    lua_setmetatable(&l, -2);
+}
+} // namespace detail
+
 /**
  * Create a new lua userdata of, allocating space for a specific
  * type of object and return a reference. NOTE: This does NOT call
@@ -34,8 +132,7 @@ template<typename T>
 inline T& newUserdata(lua_State& l) {
     T* t = static_cast<T*>(lua_newuserdata(&l, sizeof(T)));
     if(t == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
-    luaL_newmetatable(&l, ::glua::detail::type_traits<T>::name);
-    lua_setmetatable(&l, -2);
+    detail::_set_type_metatable<T>(l);
     return *t;
 }
 
@@ -48,13 +145,49 @@ inline T& newUserdata(lua_State& l, const char* name) {
     return *t;
 }
 
+/**
+ * If the object at index index is a userdata of type T, return a
+ * pointer to it, otherwise return nullptr. Compares metatables by
+ * their cached registry entry rather than by name.
+ */
+template<typename T>
+inline T* testUserdata(lua_State& l, int index) {
+    void* p = lua_touserdata(&l, index);
+    if(p == nullptr || !lua_getmetatable(&l, index)) return nullptr;
+    lua_rawgetp(&l, LUA_REGISTRYINDEX, detail::_type_key<T>());
+    if(lua_isnil(&l, -1)) {
+        // Metatable not created through newUserdata<T>; fall back to the name
+        lua_pop(&l, 2);
+        return static_cast<T*>(luaL_testudata(&l, index, ::glua::detail::type_traits<T>::name));
+    }
+    bool same = lua_rawequal(&l, -1, -2);
+    lua_pop(&l, 2);
+    return same ? static_cast<T*>(p) : nullptr;
+}
+
+/**
+ * If the object at index index is a std::shared_ptr<T> pushed into
+ * lua, return a pointer to it, otherwise return nullptr.
+ */
+template<typename T>
+inline std::shared_ptr<T>* testSharedUserdata(lua_State& l, int index) {
+    using holder = detail::_ptr_holder<T, std::shared_ptr<T>>;
+    T** p = testUserdata<T*>(l, index);
+    if(p == nullptr || lua_rawlen(&l, index) < sizeof(holder)) return nullptr;
+    holder* h = reinterpret_cast<holder*>(p);
+    if(h->header.destroy != &detail::_destroy_holder<T, std::shared_ptr<T>>) return nullptr;
+    return &h->owner;
+}
+
 /**
  * If the object at index index is userdata, return a reference
  * to it. Otherwise throw an error.
  */
 template<typename T>
 inline T& getUserdata(lua_State& l, int index) {
-    T* t = static_cast<T*>(luaL_checkudata(&l, index, ::glua::detail::type_traits<T>::name));
+    T* t = testUserdata<T>(l, index);
+    if(t != nullptr) return *t;
+    t = static_cast<T*>(luaL_checkudata(&l, index, ::glua::detail::type_traits<T>::name));
     if(t == nullptr) throw std::runtime_error("Error: trying to get non-userdata as userdata");
     else return *t;
 }
@@ -77,7 +210,7 @@ namespace detail {
  * This set of methods is implemented using a struct
  * because partial specialization is required
  */
-template<typename T>
+template<typename T, typename = void>
 struct _push_impl {
     inline static void push(lua_State& l, T val) {
         T* data = &newUserdata<T>(l);
@@ -111,43 +244,77 @@ struct _push_impl<T*> {
     }
 };
 
-/** 
- * Push implementaiton for bool
+/**
+ * Push a userdata of T* owning owner, released by __gc. An empty
+ * owner is pushed as nil.
  */
-template<>
-struct _push_impl<bool> {
-    inline static void push(lua_State& l, bool val) {
-        lua_pushboolean(&l, val);
+template<typename T, typename Owner>
+inline void _push_owner(lua_State& l, Owner owner) {
+    T* ptr = owner.get();
+    if(ptr == nullptr) {
+        lua_pushnil(&l);
+        return;
+    }
+    using holder = _ptr_holder<T, Owner>;
+    holder* h = static_cast<holder*>(lua_newuserdata(&l, sizeof(holder)));
+    if(h == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+    h->header.ptr = ptr;
+    h->header.destroy = nullptr;
+    _set_type_metatable<T*>(l);
+    new (&h->owner) Owner(std::move(owner));
+    h->header.destroy = &_destroy_holder<T, Owner>;
+}
+
+/**
+ * Push implementaiton for std::unique_ptr: lua takes ownership.
+ * The userdata has type T*, so it is read like a plain pointer.
+ */
+template<typename T, typename D>
+struct _push_impl<std::unique_ptr<T, D>> {
+    inline static void push(lua_State& l, std::unique_ptr<T, D> val) {
+        _push_owner<T>(l, std::move(val));
+    }
+};
+
+/**
+ * Push implementaiton for std::shared_ptr: lua shares ownership.
+ */
+template<typename T>
+struct _push_impl<std::shared_ptr<T>> {
+    inline static void push(lua_State& l, std::shared_ptr<T> val) {
+        _push_owner<T>(l, std::move(val));
     }
 };
 
 /** 
- * Push implementaiton for integers
+ * Push implementaiton for bool
  */
 template<>
-struct _push_impl<lua_Integer> {
-    inline static void push(lua_State& l, lua_Integer val) {
-        lua_pushinteger(&l, val);
+struct _push_impl<bool> {
+    inline static void push(lua_State& l, bool val) {
+        lua_pushboolean(&l, val);
     }
 };
 
 /** 
- * Push implementaiton for unsigned integers
+ * Push implementaiton for integral types, passed as lua_Integer
+ * (see compat.hpp for the 5.2 exceptions).
  */
-template<>
-struct _push_impl<lua_Unsigned> {
-    inline static void push(lua_State& l, lua_Unsigned val) {
-        lua_pushunsigned(&l, val);
+template<typename T>
+struct _push_impl<T, typename std::enable_if<::glua::detail::_is_lua_integral<T>::value>::type> {
+    inline static void push(lua_State& l, T val) {
+        ::glua::detail::_push_integral(&l, val);
     }
 };
 
 /** 
- * Push implementaiton for the lua_Number type (usually double)
+ * Push implementaiton for floating point types, passed as
+ * lua_Number (usually double)
  */
-template<>
-struct _push_impl<lua_Number> {
-    inline static void push(lua_State& l, lua_Number val) {
-        lua_pushnumber(&l, val);
+template<typename T>
+struct _push_impl<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    inline static void push(lua_State& l, T val) {
+        lua_pushnumber(&l, static_cast<lua_Number>(val));
     }
 };
 
@@ -171,6 +338,18 @@ struct _push_impl<std::string> {
     }
 };
 
+#ifdef GLUA_STRING_VIEW
+/** 
+ * Push implementaiton for string views
+ */
+template<>
+struct _push_impl<std::string_view> {
+    inline static void push(lua_State& l, std::string_view val) {
+        lua_pushlstring(&l, val.data(), val.size());
+    }
+};
+#endif
+
 /** 
  * Push implementaiton for the nullptr type, which pushes nil 
  * to the lua stack.
@@ -182,14 +361,231 @@ struct _push_impl<std::nullptr_t> {
     }
 };
 
+/**
+ * The name of val given with GLUA_ENUM, or nullptr if it has none.
+ */
+template<typename T>
+inline const char* _enum_name_of(T val) {
+    size_t n = 0;
+    const ::glua::detail::_enum_name<T>* names = ::glua::detail::enum_traits<T>::names(n);
+    for(size_t i = 0; i < n; ++i) {
+        if(names[i].value == val) return names[i].name;
+    }
+    return nullptr;
+}
+
+/**
+ * Convert the value at index to the enum T: a name given with
+ * GLUA_ENUM, or a number holding the underlying integer. Returns
+ * false for anything else.
+ */
+template<typename T>
+inline bool _to_enum(lua_State& l, int index, T& out) {
+    using underlying = typename std::underlying_type<T>::type;
+    int type = lua_type(&l, index);
+    if(type == LUA_TSTRING) {
+        size_t len = 0;
+        const char* str = lua_tolstring(&l, index, &len);
+        size_t n = 0;
+        const ::glua::detail::_enum_name<T>* names = ::glua::detail::enum_traits<T>::names(n);
+        for(size_t i = 0; i < n; ++i) {
+            if(std::strlen(names[i].name) == len && std::memcmp(names[i].name, str, len) == 0) {
+                out = names[i].value;
+                return true;
+            }
+        }
+        return false;
+    }
+    if(type != LUA_TNUMBER) return false;
+    int isnum = 0;
+    out = static_cast<T>(::glua::detail::_to_integral<underlying>(&l, index, &isnum));
+    return isnum != 0;
+}
+
+/**
+ * Push implementation for enums: the name given with GLUA_ENUM, a
+ * string lua interns once, or else the underlying integer.
+ */
+template<typename T>
+struct _push_impl<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    inline static void push(lua_State& l, T val) {
+        const char* name = _enum_name_of(val);
+        if(name != nullptr) lua_pushstring(&l, name);
+        else ::glua::detail::_push_integral(&l, static_cast<typename std::underlying_type<T>::type>(val));
+    }
+};
+
+#ifdef GLUA_VARIANT
+/**
+ * Push implementation for optionals; an empty one is nil.
+ */
+template<typename T>
+struct _push_impl<std::optional<T>> {
+    inline static void push(lua_State& l, std::optional<T> val) {
+        if(val) _push_impl<T>::push(l, std::move(*val));
+        else    lua_pushnil(&l);
+    }
+};
+
+template<>
+struct _push_impl<std::monostate> {
+    inline static void push(lua_State& l, std::monostate) {
+        lua_pushnil(&l);
+    }
+};
+
+/**
+ * Push implementation for variants, pushing the held alternative.
+ */
+template<typename... T>
+struct _push_impl<std::variant<T...>> {
+    inline static void push(lua_State& l, std::variant<T...> val) {
+        if(val.valueless_by_exception()) {
+            lua_pushnil(&l);
+            return;
+        }
+        std::visit([&l](auto& alt) {
+            _push_impl<typename std::decay<decltype(alt)>::type>::push(l, std::move(alt));
+        }, val);
+    }
+};
+
+/**
+ * Whether the value at index converts to T without error; variants
+ * hold the first alternative which accepts the value.
+ */
+template<typename T, typename = void>
+struct _variant_fits {
+    inline static bool check(lua_State& l, int index) {
+        return testUserdata<T>(l, index) != nullptr;
+    }
+};
+
+template<typename T>
+struct _variant_fits<T*> {
+    inline static bool check(lua_State& l, int index) {
+        return testUserdata<T*>(l, index) != nullptr;
+    }
+};
+
+template<typename T>
+struct _variant_fits<std::shared_ptr<T>> {
+    inline static bool check(lua_State& l, int index) {
+        return testSharedUserdata<T>(l, index) != nullptr;
+    }
+};
+
+template<>
+struct _variant_fits<bool> {
+    inline static bool check(lua_State& l, int index) {
+        return lua_type(&l, index) == LUA_TBOOLEAN;
+    }
+};
+
+template<typename T>
+struct _variant_fits<T, typename std::enable_if<::glua::detail::_is_lua_integral<T>::value>::type> {
+    inline static bool check(lua_State& l, int index) {
+        if(lua_type(&l, index) != LUA_TNUMBER) return false;
+        int isnum = 0;
+        T val = ::glua::detail::_to_integral<T>(&l, index, &isnum);
+#ifdef GLUA_NATIVE_INTEGERS
+        (void)val;
+        return isnum != 0;
+#else
+        // Without integers any number converts, truncated; only take exact ones
+        return isnum != 0 && lua_tonumber(&l, index) == static_cast<lua_Number>(val);
+#endif
+    }
+};
+
+template<typename T>
+struct _variant_fits<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    inline static bool check(lua_State& l, int index) {
+        return lua_type(&l, index) == LUA_TNUMBER;
+    }
+};
+
+template<typename T>
+struct _variant_fits<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    inline static bool check(lua_State& l, int index) {
+        T val = T();
+        return _to_enum(l, index, val);
+    }
+};
+
+template<typename T>
+struct _variant_fits<T, typename std::enable_if<
+    std::is_same<T, std::string>::value || std::is_same<T, std::string_view>::value>::type> {
+    inline static bool check(lua_State& l, int index) {
+        return lua_type(&l, index) == LUA_TSTRING;
+    }
+};
+
+template<>
+struct _variant_fits<const char*> {
+    inline static bool check(lua_State& l, int index) {
+        return lua_type(&l, index) == LUA_TSTRING;
+    }
+};
+
+template<typename T>
+struct _variant_fits<T, typename std::enable_if<
+    std::is_same<T, std::nullptr_t>::value || std::is_same<T, std::monostate>::value>::type> {
+    inline static bool check(lua_State& l, int index) {
+        return lua_isnoneornil(&l, index);
+    }
+};
+
+template<typename T>
+struct _variant_fits<std::optional<T>> {
+    inline static bool check(lua_State& l, int index) {
+        return lua_isnoneornil(&l, index) || _variant_fits<T>::check(l, index);
+    }
+};
+
+template<typename... T>
+struct _variant_fits<std::variant<T...>> {
+    inline static bool check(lua_State& l, int index) {
+        return (_variant_fits<T>::check(l, index) || ...);
+    }
+};
+
+/**
+ * Convert the value at index with Get (_check_get_impl or _arg_impl)
+ * to the first alternative of V which accepts it. Returns false,
+ * leaving out empty, if none does.
+ */
+template<template<typename, typename> class Get, typename V, size_t... I>
+inline bool _variant_select(lua_State& l, int index, std::optional<V>& out, std::index_sequence<I...>) {
+    return ((_variant_fits<std::variant_alternative_t<I, V>>::check(l, index) &&
+             (out.emplace(std::in_place_index<I>, Get<std::variant_alternative_t<I, V>, void>::get(l, index)), true)) || ...);
+}
+#endif
+
 /**
  * Template struct supplying an implementaiton to 
  * push an arbitrary number of arbitrary values onto
  * the lua stack.
  *
- * This method is implemented using a struct because
- * partial specialization is required.
+ * The pack is expanded in place rather than recursively,
+ * so each signature instantiates only this one struct.
+ * GLUA_RECURSIVE_TEMPLATES selects the original recursive
+ * implementation, which instantiates one struct per value.
  */
+#ifndef GLUA_RECURSIVE_TEMPLATES
+template<typename... T>
+struct _push_n_impl {
+    inline static void push(lua_State& l, T... vals) {
+#ifdef GLUA_FOLD_EXPRESSIONS
+        (_push_impl<T>::push(l, std::move(vals)), ...);
+#else
+        // Braced initializers are evaluated left to right
+        int expand[] = { 0, (_push_impl<T>::push(l, std::move(vals)), 0)... };
+        (void)expand;
+#endif
+    }
+};
+#else
 template<typename... T>
 struct _push_n_impl {};
 
@@ -200,20 +596,30 @@ struct _push_n_impl {};
 template<typename T1, typename... T>
 struct _push_n_impl<T1, T...> {
     inline static void push(lua_State& l, T1 val1, T... vals) {
-        _push_impl<T1>::push(l, val1);
-        _push_n_impl<T...>::push(l, vals...);
+        _push_impl<T1>::push(l, std::move(val1));
+        _push_n_impl<T...>::push(l, std::move(vals)...);
     }
 };
 
+/**
+ * Specialization for pushing nothing, e.g. the arguments
+ * of a call with no parameters.
+ */
+template<>
+struct _push_n_impl<> {
+    inline static void push(lua_State&) {}
+};
+
 /**
  * Specialization for pushing a single value.
  */
 template<typename T>
 struct _push_n_impl<T> {
     inline static void push(lua_State& l, T val) {
-        _push_impl<T>::push(l, val);
+        _push_impl<T>::push(l, std::move(val));
     }
 };
+#endif
 } // namespace detail
 
 /**
@@ -221,7 +627,7 @@ struct _push_n_impl<T> {
  */
 template<typename... T>
 inline void push(lua_State& l, T... vals) {
-    detail::_push_n_impl<T...>::push(l, vals...);
+    detail::_push_n_impl<T...>::push(l, std::move(vals)...);
 }
 
 namespace detail {
@@ -331,7 +737,7 @@ namespace detail {
  * This method is implemented using a struct because partial
  * specialization is requied.
  */
-template<typename T>
+template<typename T, typename = void>
 struct _check_get_impl {
     /*
     inline static auto get(lua_State& l, int index) 
@@ -380,42 +786,51 @@ struct _check_get_impl<T*> {
 };
 
 /**
- * Partial specialization for booleans.
+ * Partial specialization for shared pointers. nil gives an empty
+ * pointer.
  */
-template<>
-struct _check_get_impl<bool> {
-    inline static bool get(lua_State& l, int index) {
-        return lua_toboolean(&l, index);
+template<typename T>
+struct _check_get_impl<std::shared_ptr<T>> {
+    inline static std::shared_ptr<T> get(lua_State& l, int index)
+    {
+        if(lua_isnil(&l, index)) return std::shared_ptr<T>();
+        std::shared_ptr<T>* owner = testSharedUserdata<T>(l, index);
+        if(owner == nullptr) luaL_argerror(&l, index, "shared_ptr expected");
+        return *owner;
     }
 };
 
 /**
- * Partial specialization for integers.
+ * Partial specialization for booleans.
  */
 template<>
-struct _check_get_impl<lua_Integer> {
-    inline static lua_Integer get(lua_State& l, int index) {
-        return luaL_checkinteger(&l, index);
+struct _check_get_impl<bool> {
+    inline static bool get(lua_State& l, int index) {
+        return lua_toboolean(&l, index);
     }
 };
 
 /**
- * Partial specialization for unsigned integers.
+ * Partial specialization for integral types. With native integers
+ * a float without an exact integer value is an error.
  */
-template<>
-struct _check_get_impl<lua_Unsigned> {
-    inline static lua_Unsigned get(lua_State& l, int index) {
-        return luaL_checkunsigned(&l, index);
+template<typename T>
+struct _check_get_impl<T, typename std::enable_if<::glua::detail::_is_lua_integral<T>::value>::type> {
+    inline static T get(lua_State& l, int index) {
+        int isnum = 0;
+        T val = ::glua::detail::_to_integral<T>(&l, index, &isnum);
+        if(!isnum) luaL_argerror(&l, index, "integer expected");
+        return val;
     }
 };
 
 /**
- * Partial specialization for the lua_Number type (usually double).
+ * Partial specialization for floating point types.
  */
-template<>
-struct _check_get_impl<lua_Number> {
-    inline static lua_Number get(lua_State& l, int index) {
-        return luaL_checknumber(&l, index);
+template<typename T>
+struct _check_get_impl<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    inline static T get(lua_State& l, int index) {
+        return static_cast<T>(luaL_checknumber(&l, index));
     }
 };
 
@@ -441,6 +856,69 @@ struct _check_get_impl<const char*> {
     }
 };
 
+#ifdef GLUA_STRING_VIEW
+/**
+ * Partial specialization for string views. The view points into
+ * the lua string, so it is only valid while that is on the stack.
+ */
+template<>
+struct _check_get_impl<std::string_view> {
+    inline static std::string_view get(lua_State& l, int index) {
+        size_t      len = 0;
+        const char* str = luaL_checklstring(&l, index, &len);
+        return std::string_view(str, len);
+    }
+};
+#endif
+
+/**
+ * Partial specialization for enums, from a name or an integer.
+ */
+template<typename T>
+struct _check_get_impl<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    inline static T get(lua_State& l, int index) {
+        T val = T();
+        if(!_to_enum(l, index, val)) luaL_argerror(&l, index, "enum value expected");
+        return val;
+    }
+};
+
+#ifdef GLUA_VARIANT
+/**
+ * Partial specialization for optionals; nil (or no value) gives an
+ * empty one.
+ */
+template<typename T>
+struct _check_get_impl<std::optional<T>> {
+    inline static std::optional<T> get(lua_State& l, int index) {
+        if(lua_isnoneornil(&l, index)) return std::nullopt;
+        return std::optional<T>(_check_get_impl<T>::get(l, index));
+    }
+};
+
+template<>
+struct _check_get_impl<std::monostate> {
+    inline static std::monostate get(lua_State&, int) {
+        return std::monostate();
+    }
+};
+
+/**
+ * Partial specialization for variants, holding the first
+ * alternative which accepts the value.
+ */
+template<typename... T>
+struct _check_get_impl<std::variant<T...>> {
+    inline static std::variant<T...> get(lua_State& l, int index) {
+        std::optional<std::variant<T...>> out;
+        if(!_variant_select<_check_get_impl>(l, index, out, std::index_sequence_for<T...>())) {
+            luaL_argerror(&l, index, "no variant alternative matches");
+        }
+        return std::move(*out);
+    }
+};
+#endif
+
 /**
  * Template struct providing an implementation for getting
  * an arbitrary number of arbitrary values from the lua stack.
@@ -506,6 +984,287 @@ inline auto checkGet(lua_State& l)
     return detail::_check_get_n_impl<T>::get(l);
 }
 
+namespace detail {
+
+/**
+ * Where the running C function was called from and the name it was
+ * called by, as luaL_argerror reports them.
+ */
+struct _call_site {
+    std::string where;
+    std::string name;
+    bool method;
+
+    explicit _call_site(lua_State& l) : name("?"), method(false) {
+        lua_Debug ar;
+        if(lua_getstack(&l, 0, &ar)) {
+            lua_getinfo(&l, "n", &ar);
+            if(ar.name != nullptr) name = ar.name;
+            method = ar.namewhat != nullptr && std::strcmp(ar.namewhat, "method") == 0;
+        }
+        luaL_where(&l, 1);
+        where = lua_tostring(&l, -1);
+        lua_pop(&l, 1);
+    }
+};
+
+/**
+ * Cold path for argument checking: throws a description of the
+ * offending argument worded like luaL_argerror. The exception is
+ * turned into a lua error by the wrapper (see cfunction.hpp), after
+ * the stack has unwound.
+ */
+#if defined(__GNUC__)
+__attribute__((cold, noinline))
+#endif
+[[noreturn]] inline void _arg_error(lua_State& l, int index, const char* expected) {
+    std::string got = luaL_typename(&l, index);
+    _call_site site(l);
+    // self is not counted for methods
+    if(site.method && --index == 0) {
+        throw std::runtime_error(site.where + "calling '" + site.name + "' on bad self");
+    }
+    throw std::runtime_error(
+        site.where + "bad argument #" + std::to_string(index) + " to '" + site.name + "' (" +
+        expected + " expected, got " + got + ")");
+}
+
+#if defined(__GNUC__)
+__attribute__((cold, noinline))
+#endif
+[[noreturn]] inline void _arity_error(lua_State& l, int expected) {
+    _call_site site(l);
+    throw std::runtime_error(
+        site.where + "wrong number of arguments to '" + site.name + "' (expected " +
+        std::to_string(expected) + ", got " + std::to_string(lua_gettop(&l)) + ")");
+}
+
+/**
+ * Template struct supplying the implementation of checkArgs for a
+ * single argument at an absolute stack index. Unlike _check_get_impl
+ * no lua error is raised; a mismatch goes to _arg_error.
+ *
+ * Default implementation treats the argument as userdata of type T
+ * and returns a copy.
+ */
+template<typename T, typename = void>
+struct _arg_impl {
+    inline static T get(lua_State& l, int index) {
+        T* t = testUserdata<T>(l, index);
+        if(t == nullptr) _arg_error(l, index, ::glua::detail::type_traits<T>::name);
+        return *t;
+    }
+};
+
+/**
+ * Arguments taken by const reference are read by value.
+ */
+template<typename T>
+struct _arg_impl<const T&> : public _arg_impl<T> {};
+
+/**
+ * Partial specialization for pointer types.
+ */
+template<typename T>
+struct _arg_impl<T*> {
+    inline static T* get(lua_State& l, int index) {
+        T** t = testUserdata<T*>(l, index);
+        if(t == nullptr) _arg_error(l, index, ::glua::detail::type_traits<T*>::name);
+        return *t;
+    }
+};
+
+/**
+ * Arguments taken by reference refer to the object of a T userdata,
+ * or to the one a T* userdata (plain or owning) points to.
+ */
+template<typename T>
+struct _arg_impl<T&> {
+    inline static T& get(lua_State& l, int index) {
+        T** p = testUserdata<T*>(l, index);
+        if(p != nullptr && *p != nullptr) return **p;
+        T* t = testUserdata<T>(l, index);
+        if(t == nullptr) _arg_error(l, index, ::glua::detail::type_traits<T>::name);
+        return *t;
+    }
+};
+
+/**
+ * Partial specialization for shared pointers. nil gives an empty
+ * pointer.
+ */
+template<typename T>
+struct _arg_impl<std::shared_ptr<T>> {
+    inline static std::shared_ptr<T> get(lua_State& l, int index) {
+        if(lua_isnil(&l, index)) return std::shared_ptr<T>();
+        std::shared_ptr<T>* owner = testSharedUserdata<T>(l, index);
+        if(owner == nullptr) _arg_error(l, index, "shared_ptr");
+        return *owner;
+    }
+};
+
+template<>
+struct _arg_impl<bool> {
+    inline static bool get(lua_State& l, int index) {
+        return lua_toboolean(&l, index);
+    }
+};
+
+template<typename T>
+struct _arg_impl<T, typename std::enable_if<::glua::detail::_is_lua_integral<T>::value>::type> {
+    inline static T get(lua_State& l, int index) {
+        int isnum = 0;
+        T val = ::glua::detail::_to_integral<T>(&l, index, &isnum);
+        if(!isnum) _arg_error(l, index, "integer");
+        return val;
+    }
+};
+
+template<typename T>
+struct _arg_impl<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    inline static T get(lua_State& l, int index) {
+        int isnum = 0;
+        lua_Number val = lua_tonumberx(&l, index, &isnum);
+        if(!isnum) _arg_error(l, index, "number");
+        return static_cast<T>(val);
+    }
+};
+
+template<>
+struct _arg_impl<std::string> {
+    inline static std::string get(lua_State& l, int index) {
+        size_t      len = 0;
+        const char* str = lua_tolstring(&l, index, &len);
+        if(str == nullptr) _arg_error(l, index, "string");
+        return std::string(str, len);
+    }
+};
+
+template<>
+struct _arg_impl<const char*> {
+    inline static const char* get(lua_State& l, int index) {
+        const char* str = lua_tostring(&l, index);
+        if(str == nullptr) _arg_error(l, index, "string");
+        return str;
+    }
+};
+
+#ifdef GLUA_STRING_VIEW
+template<>
+struct _arg_impl<std::string_view> {
+    inline static std::string_view get(lua_State& l, int index) {
+        size_t      len = 0;
+        const char* str = lua_tolstring(&l, index, &len);
+        if(str == nullptr) _arg_error(l, index, "string");
+        return std::string_view(str, len);
+    }
+};
+#endif
+
+template<typename T>
+struct _arg_impl<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    inline static T get(lua_State& l, int index) {
+        T val = T();
+        if(!_to_enum(l, index, val)) _arg_error(l, index, "enum value");
+        return val;
+    }
+};
+
+#ifdef GLUA_VARIANT
+/**
+ * Optional arguments may be nil or left out, when they come last.
+ */
+template<typename T>
+struct _arg_impl<std::optional<T>> {
+    inline static std::optional<T> get(lua_State& l, int index) {
+        if(lua_isnoneornil(&l, index)) return std::nullopt;
+        return std::optional<T>(_arg_impl<T>::get(l, index));
+    }
+};
+
+template<>
+struct _arg_impl<std::monostate> {
+    inline static std::monostate get(lua_State&, int) {
+        return std::monostate();
+    }
+};
+
+template<typename... T>
+struct _arg_impl<std::variant<T...>> {
+    inline static std::variant<T...> get(lua_State& l, int index) {
+        std::optional<std::variant<T...>> out;
+        if(!_variant_select<_arg_impl>(l, index, out, std::index_sequence_for<T...>())) {
+            _arg_error(l, index, "variant alternative");
+        }
+        return std::move(*out);
+    }
+};
+#endif
+
+/**
+ * The number of arguments which must be passed: trailing optional
+ * parameters may be left out.
+ */
+template<typename T>
+struct _is_optional : std::false_type {};
+
+#ifdef GLUA_VARIANT
+template<typename T>
+struct _is_optional<std::optional<T>> : std::true_type {};
+#endif
+
+template<typename... T>
+struct _required_args {
+    static constexpr int value = 0;
+};
+
+template<typename T, typename... Rest>
+struct _required_args<T, Rest...> {
+    static constexpr int value = _required_args<Rest...>::value > 0 ? 1 + _required_args<Rest...>::value :
+        (_is_optional<typename std::decay<T>::type>::value ? 0 : 1);
+};
+
+template<typename T>
+struct _check_args_impl {};
+
+/**
+ * Reads the arguments of a C function call: checks the arity once,
+ * then reads argument i from absolute index i, so neither the reads
+ * nor the error path depend on how many extra values follow.
+ */
+template<typename... T>
+struct _check_args_impl<std::tuple<T...>> {
+    template<int... I>
+    inline static auto work(lua_State& l, ::glua::detail::_index_list<I...>)
+    -> decltype(make<std::tuple>(_arg_impl<T>::get(l, I + 1)...))
+    {
+        return make<std::tuple>(_arg_impl<T>::get(l, I + 1)...);
+    }
+
+    inline static auto get(lua_State& l)
+    -> decltype(work(l, typename ::glua::detail::_build_index_list<sizeof...(T)>::build()))
+    {
+        if(lua_gettop(&l) < _required_args<T...>::value) _arity_error(l, _required_args<T...>::value);
+        return work(l, typename ::glua::detail::_build_index_list<sizeof...(T)>::build());
+    }
+};
+
+} // namespace detail
+
+/**
+ * Get the arguments of a C function call as a tuple, where Tuple is
+ * the std::tuple of parameter types. Used by the generated wrappers.
+ * Mismatched arguments throw std::runtime_error.
+ */
+template<typename Tuple>
+inline auto checkArgs(lua_State& l)
+#if __cplusplus <= 201103L
+-> decltype(detail::_check_args_impl<Tuple>::get(l))
+#endif
+{
+    return detail::_check_args_impl<Tuple>::get(l);
+}
+
 /**
  * Clear the stack.
  */
@@ -519,6 +1278,31 @@ inline void clearStack(lua_State& l) {
 inline lua_State& open() {
     lua_State* l = luaL_newstate();
     if(l == nullptr) throw std::runtime_error("Couldn't create new lua state!");
+    ::glua::detail::_set_main_thread(l);
+    return *l;
+}
+
+namespace detail {
+/**
+ * Panic function for states created with a custom allocator,
+ * matching the one luaL_newstate installs.
+ */
+inline int _panic(lua_State* l) {
+    const char* msg = lua_tostring(l, -1);
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg ? msg : "?");
+    return 0;
+}
+} // namespace detail
+
+/**
+ * Create a new lua_State which uses a custom allocation function.
+ * LuaJIT only supports this on 64-bit targets when built with GC64.
+ */
+inline lua_State& open(lua_Alloc alloc, void* ud) {
+    lua_State* l = lua_newstate(alloc, ud);
+    if(l == nullptr) throw std::runtime_error("Couldn't create new lua state!");
+    lua_atpanic(l, &detail::_panic);
+    ::glua::detail::_set_main_thread(l);
     return *l;
 }
 
@@ -537,38 +1321,47 @@ inline void close(lua_State& l) {
 }
 
 /**
- * Execute a lua object on the stack.
+ * Execute a lua object on the stack in protected mode. If the call
+ * raises an error, the error is popped and thrown as a glua::error
+ * (script_error, memory_error, ...) with the traceback attached.
  */
 inline void call(lua_State& l, int nargs, int nret) {
-    lua_call(&l, nargs, nret);
+    int status = ::glua::detail::_pcall(l, nargs, nret);
+    if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
 }
 
 /**
  * Load a lua file and run it.
  */
 inline void loadFile(lua_State& l, const char* filename) {
-    luaL_dofile(&l, filename);
+    int status = luaL_loadfile(&l, filename);
+    if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+    call(l, 0, LUA_MULTRET);
 }
 
 /**
  * Load a lua file and run it.
  */
 inline void loadFile(lua_State& l, std::string filename) {
-    luaL_dofile(&l, filename.c_str());
+    loadFile(l, filename.c_str());
 }
 
 /**
  * Load and run a string as a lua chunk.
  */
 inline void loadString(lua_State& l, const char* chunk) {
-    luaL_dostring(&l, chunk);
+    int status = luaL_loadstring(&l, chunk);
+    if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+    call(l, 0, LUA_MULTRET);
 }
 
 /**
  * Load and run a string as a lua chunk.
  */
 inline void loadString(lua_State& l, std::string chunk) {
-    luaL_dostring(&l, chunk.c_str());
+    int status = luaL_loadbuffer(&l, chunk.data(), chunk.size(), chunk.c_str());
+    if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+    call(l, 0, LUA_MULTRET);
 }
 
 /**
@@ -0,0 +1,96 @@
+/**
+ * args.cpp
+ * Measures the per-call cost of the argument checking done by the
+ * generated cfunction wrappers for functions of 0 to 8 arguments,
+ * comparing api::checkArgs (arity checked once, absolute indices)
+ * with the per-argument luaL_check* path of api::checkGet.
+ *
+ * Each function is called from a lua loop; the cost of the loop and
+ * of calling an empty C function is measured separately and
+ * subtracted. Output is one JSON object per line.
+ */
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "../state.hpp"
+
+namespace {
+
+using num = lua_Number;
+
+num f0() { return 0; }
+num f1(num a) { return a; }
+num f2(num a, num b) { return a + b; }
+num f3(num a, num b, num c) { return a + b + c; }
+num f4(num a, num b, num c, num d) { return a + b + c + d; }
+num f5(num a, num b, num c, num d, num e) { return a + b + c + d + e; }
+num f6(num a, num b, num c, num d, num e, num f) { return a + b + c + d + e + f; }
+num f7(num a, num b, num c, num d, num e, num f, num g) { return a + b + c + d + e + f + g; }
+num f8(num a, num b, num c, num d, num e, num f, num g, num h) { return a + b + c + d + e + f + g + h; }
+
+/**
+ * The wrapper as generated before checkArgs existed.
+ */
+template<typename FuncT, FuncT func>
+int legacy(lua_State* l) {
+    using argument_types = typename glua::function_traits<FuncT>::argument_types;
+    num val = glua::call_with_tuple(func, glua::api::checkGet<argument_types>(*l));
+    glua::api::clearStack(*l);
+    glua::api::push<num>(*l, val);
+    return 1;
+}
+
+int empty(lua_State*) {
+    return 0;
+}
+
+const long iterations = 2000000;
+
+/**
+ * Nanoseconds per iteration of a loop calling the global "f" with
+ * nargs arguments.
+ */
+double time_calls(lua_State& l, int nargs) {
+    std::string args;
+    for(int i = 0; i < nargs; ++i) args += (i ? ", " : "") + std::to_string(i + 1);
+    std::string chunk = "local f = f for i = 1, " + std::to_string(iterations) + " do f(" + args + ") end";
+
+    auto start = std::chrono::steady_clock::now();
+    glua::api::loadString(l, chunk);
+    auto end = std::chrono::steady_clock::now();
+    glua::api::clearStack(l);
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+double time_function(lua_State& l, lua_CFunction f, int nargs) {
+    lua_pushcfunction(&l, f);
+    lua_setglobal(&l, "f");
+    return time_calls(l, nargs);
+}
+
+template<typename FuncT, FuncT func>
+void run(lua_State& l, int nargs) {
+    double base   = time_function(l, &empty, nargs);
+    double fast   = time_function(l, &glua::cfunction<FuncT, func>::wrapper, nargs) - base;
+    double before = time_function(l, &legacy<FuncT, func>, nargs) - base;
+    std::printf("{\"bench\":\"args\",\"nargs\":%d,\"checkGet_ns\":%.2f,\"checkArgs_ns\":%.2f,\"saving_ns\":%.2f}\n",
+                nargs, before, fast, before - fast);
+}
+
+} // namespace
+
+int main() {
+    lua_State& l = glua::api::open();
+    glua::api::openLibs(l);
+    run<decltype(&f0), &f0>(l, 0);
+    run<decltype(&f1), &f1>(l, 1);
+    run<decltype(&f2), &f2>(l, 2);
+    run<decltype(&f3), &f3>(l, 3);
+    run<decltype(&f4), &f4>(l, 4);
+    run<decltype(&f5), &f5>(l, 5);
+    run<decltype(&f6), &f6>(l, 6);
+    run<decltype(&f7), &f7>(l, 7);
+    run<decltype(&f8), &f8>(l, 8);
+    glua::api::close(l);
+}
@@ -0,0 +1,80 @@
+#!/bin/sh
+# compile.sh
+# Compile-time benchmark: generates a translation unit registering N
+# synthetic bindings of varying arity and compiles it once for each
+# implementation mode, reporting build time and object size as JSON
+# lines, so template bloat can be tracked over time.
+#
+#   ./compile.sh [N]
+#
+# Modes:
+#   recursive  C++11, recursive index lists and pack expansion
+#   sequence   C++14, std::integer_sequence
+#   fold       C++17, std::integer_sequence and fold expressions
+#
+# CXX, CXXFLAGS and LUA are taken from the environment, as in the
+# Makefile. Only the object file is built, so no lua library is needed.
+
+set -e
+
+N=${1:-200}
+CXX=${CXX:-c++}
+CXXFLAGS=${CXXFLAGS:--O2}
+LUA=${LUA:-lua5.2}
+LUA_CFLAGS=$(pkg-config --cflags "$LUA" 2>/dev/null || true)
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+src="$dir/bindings.cpp"
+
+{
+    echo '#include <string>'
+    echo '#include "state.hpp"'
+    echo 'using num = lua_Number;'
+    echo 'using str = std::string;'
+    i=0
+    while [ $i -lt "$N" ]; do
+        # Arity 0 to 5, with a different mix of parameter types per binding
+        case $((i % 6)) in
+            0) params="";                                   body="$i" ;;
+            1) params="num a";                              body="a + $i" ;;
+            2) params="num a, str b";                       body="a + b.size()" ;;
+            3) params="num a, bool b, num c";               body="b ? a : c" ;;
+            4) params="str a, num b, str c, num d";         body="a.size() + b + c.size() + d" ;;
+            5) params="num a, num b, bool c, str d, num e"; body="c ? a + b : d.size() + e" ;;
+        esac
+        echo "static num f$i($params) { return $body; }"
+        i=$((i + 1))
+    done
+    echo 'void bind(glua::state& s) {'
+    i=0
+    while [ $i -lt "$N" ]; do
+        echo "    s.registerFunction<decltype(&f$i), &f$i>(\"f$i\");"
+        i=$((i + 1))
+    done
+    echo '}'
+} > "$src"
+
+now() {
+    date +%s%N
+}
+
+run() {
+    mode=$1
+    shift
+    obj="$dir/$mode.o"
+    start=$(now)
+    # shellcheck disable=SC2086
+    $CXX "$@" $CXXFLAGS $LUA_CFLAGS -I"$ROOT" -c -o "$obj" "$src"
+    end=$(now)
+    ms=$(( (end - start) / 1000000 ))
+    bytes=$(wc -c < "$obj" | tr -d ' ')
+    text=$(size "$obj" | awk 'NR == 2 { print $1 }')
+    printf '{"bench":"compile","mode":"%s","bindings":%d,"ms":%d,"object_bytes":%d,"text_bytes":%d}\n' \
+        "$mode" "$N" "$ms" "$bytes" "$text"
+}
+
+run recursive -std=c++11 -DGLUA_RECURSIVE_TEMPLATES
+run sequence  -std=c++14
+run fold      -std=c++17
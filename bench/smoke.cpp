@@ -0,0 +1,96 @@
+/**
+ * smoke.cpp
+ * Smoke test of the version-dependent parts of glua, run against
+ * each backend by 'make backends' before the benchmarks: number
+ * marshalling with and without native integers, channels and blobs
+ * keeping the integer subtype, coroutine resumption and budgets.
+ *
+ * Prints one line per failed check and exits with status 1 if any
+ * failed.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "../state.hpp"
+#include "../blob.hpp"
+#include "../channel.hpp"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+    if(ok) return;
+    std::printf("smoke: FAILED %s\n", what);
+    ++failures;
+}
+
+int64_t twice(int64_t x) { return 2 * x; }
+
+} // namespace
+
+int main() {
+    glua::state s;
+    s.registerFunction<decltype(&twice), &twice>("twice");
+
+    s["u"] = std::numeric_limits<uint32_t>::max();
+    check(s["u"].get<uint32_t>() == std::numeric_limits<uint32_t>::max(), "uint32 round trip");
+    s["d"] = 0.5;
+    check(s["d"].get<double>() == 0.5, "double round trip");
+    s.run("t = twice(21)");
+    check(s["t"].get<int>() == 42, "integral arguments and results");
+#ifdef GLUA_NATIVE_INTEGERS
+    const int64_t big = (int64_t(1) << 53) + 1;
+    s["big"] = big;
+    check(s["big"].get<int64_t>() == big, "int64 beyond 2^53");
+    s.run("itype = math.type(twice(1))");
+    check(s["itype"].get<std::string>() == "integer", "integral results are integers");
+#endif
+
+    // Channels and blobs keep integers integers
+    glua::state other;
+    auto ch = std::make_shared<glua::channel>(4);
+    s["ch"] = ch;
+    other["ch"] = ch;
+    s.run("ch:send(7, 0.25, 'x')");
+    other.run("a, b, c = ch:recv()");
+    check(other["a"].get<int>() == 7 && other["b"].get<double>() == 0.25 &&
+          other["c"].get<std::string>() == "x", "channel values");
+    lua_State* raw = luaL_newstate();
+    luaL_loadstring(raw, "return {n = 3, f = 1.5, list = {1, 2}}");
+    lua_call(raw, 0, 1);
+    std::string data = glua::blob_writer::build(*raw, -1);
+    lua_close(raw);
+    std::shared_ptr<glua::blob> b = glua::blob::fromMemory(data.data(), data.size());
+    s["blob"] = b;
+    s.run("bn, bf, bl = blob.n, blob.f, blob.list[2]");
+    check(s["bn"].get<int>() == 3 && s["bf"].get<double>() == 1.5 && s["bl"].get<int>() == 2, "blob values");
+#ifdef GLUA_NATIVE_INTEGERS
+    other.run("atype = math.type(a)");
+    check(other["atype"].get<std::string>() == "integer", "channel integers");
+    s.run("btype = math.type(blob.n) .. math.type(blob.f)");
+    check(s["btype"].get<std::string>() == "integerfloat", "blob integers");
+#endif
+
+    // Coroutines and budgets
+    s.run("co = coroutine.wrap(function(x) local y = coroutine.yield(x + 1) return y * 2 end)"
+          " r1 = co(1) r2 = co(5)");
+    check(s["r1"].get<int>() == 2 && s["r2"].get<int>() == 10, "coroutine resume");
+    bool exceeded = false;
+    try {
+        // LuaJIT doesn't run hooks in compiled code
+        s.run("if jit then jit.off() end while true do pcall(function() while true do end end) end",
+              glua::budget::steps(10000));
+    } catch(const glua::budget_exceeded&) {
+        exceeded = true;
+    }
+    check(exceeded, "budget_exceeded through pcall");
+    s.run("after = 1 + 1");
+    check(s["after"].get<int>() == 2, "state usable after budget");
+
+    std::printf("smoke: %s, %d failure(s)\n", LUA_VERSION, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+/**
+ * suite.cpp
+ * Microbenchmarks of the common glua paths, each next to a
+ * hand-written baseline using the raw lua C API:
+ *
+ *   global_get, global_set   reading and writing a global number
+ *   selector_nested          reading a.b.c
+ *   function_call_N          calling a lua function with N args
+ *   cfunction, cfunctor      calling a registered c++ function from lua
+ *   userdata_push/_check     pushing and reading back a c++ object
+ *   string_push/_get         marshalling a std::string
+ *   table_set/_get           writing and reading table fields
+ *
+ * Output is one JSON object per line:
+ *   {"bench":"global_get","impl":"glua","ns_per_op":3.21,"iterations":1000000}
+ */
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "../state.hpp"
+#include "../function.hpp"
+
+struct point {
+    lua_Number x, y;
+};
+
+GLUA_REG(point)
+
+namespace {
+
+const long iterations = 1000000;
+
+volatile lua_Number sink_number;
+volatile size_t sink_size;
+
+void report(const char* bench, const char* impl, double ns) {
+    std::printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"ns_per_op\":%.2f,\"iterations\":%ld}\n",
+                bench, impl, ns, iterations);
+}
+
+/**
+ * Time iterations calls of op, in nanoseconds per call.
+ */
+template<typename Op>
+double measure(Op op) {
+    auto start = std::chrono::steady_clock::now();
+    for(long i = 0; i < iterations; ++i) op();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+template<typename GluaOp, typename RawOp>
+void compare(const char* bench, GluaOp glua_op, RawOp raw_op) {
+    report(bench, "glua", measure(glua_op));
+    report(bench, "raw", measure(raw_op));
+}
+
+lua_Number add(lua_Number a, lua_Number b) {
+    return a + b;
+}
+
+int raw_add(lua_State* l) {
+    lua_pushnumber(l, luaL_checknumber(l, 1) + luaL_checknumber(l, 2));
+    return 1;
+}
+
+} // namespace
+
+int main() {
+    glua::state s;
+    lua_State* L = luaL_newstate();
+    luaL_openlibs(L);
+
+    const char* setup =
+        "x = 1.5\n"
+        "a = { b = { c = 2.5 } }\n"
+        "t = {}\n"
+        "str = string.rep('x', 64)\n"
+        "function f0() return 1 end\n"
+        "function f1(a) return a end\n"
+        "function f4(a, b, c, d) return a + b + c + d end\n";
+    s.run(setup);
+    luaL_dostring(L, setup);
+
+    // Globals
+    compare("global_get",
+        [&] { sink_number = s["x"]; },
+        [&] { lua_getglobal(L, "x"); sink_number = lua_tonumber(L, -1); lua_pop(L, 1); });
+    compare("global_set",
+        [&] { s["x"] = lua_Number(2.5); },
+        [&] { lua_pushnumber(L, 2.5); lua_setglobal(L, "x"); });
+
+    // Nested selector
+    compare("selector_nested",
+        [&] { sink_number = s["a"]["b"]["c"]; },
+        [&] {
+            lua_getglobal(L, "a");
+            lua_getfield(L, -1, "b");
+            lua_getfield(L, -1, "c");
+            sink_number = lua_tonumber(L, -1);
+            lua_settop(L, 0);
+        });
+
+    // Calling lua functions
+    {
+        glua::function<lua_Number()> f0 = s["f0"];
+        glua::function<lua_Number(lua_Number)> f1 = s["f1"];
+        glua::function<lua_Number(lua_Number, lua_Number, lua_Number, lua_Number)> f4 = s["f4"];
+        lua_getglobal(L, "f0"); int r0 = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_getglobal(L, "f1"); int r1 = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_getglobal(L, "f4"); int r4 = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        compare("function_call_0",
+            [&] { sink_number = f0(); },
+            [&] {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, r0);
+                lua_call(L, 0, 1);
+                sink_number = lua_tonumber(L, -1);
+                lua_pop(L, 1);
+            });
+        compare("function_call_1",
+            [&] { sink_number = f1(1.0); },
+            [&] {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, r1);
+                lua_pushnumber(L, 1.0);
+                lua_call(L, 1, 1);
+                sink_number = lua_tonumber(L, -1);
+                lua_pop(L, 1);
+            });
+        compare("function_call_4",
+            [&] { sink_number = f4(1.0, 2.0, 3.0, 4.0); },
+            [&] {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, r4);
+                lua_pushnumber(L, 1.0);
+                lua_pushnumber(L, 2.0);
+                lua_pushnumber(L, 3.0);
+                lua_pushnumber(L, 4.0);
+                lua_call(L, 4, 1);
+                sink_number = lua_tonumber(L, -1);
+                lua_pop(L, 1);
+            });
+    }
+
+    // Calling c++ from lua
+    {
+        s.registerFunction<decltype(&add), &add>("add");
+        s.registerFunction("addf", [](lua_Number a, lua_Number b) { return a + b; });
+        lua_register(L, "add", &raw_add);
+        lua_register(L, "addf", &raw_add);
+
+        s.run("function cfunction_loop(n) local add = add for i = 1, n do add(i, 1) end end\n"
+              "function cfunctor_loop(n) local addf = addf for i = 1, n do addf(i, 1) end end");
+        luaL_dostring(L, "function cfunction_loop(n) local add = add for i = 1, n do add(i, 1) end end\n"
+                         "function cfunctor_loop(n) local addf = addf for i = 1, n do addf(i, 1) end end");
+        const char* names[] = {"cfunction", "cfunctor"};
+        const char* loops[] = {"cfunction_loop", "cfunctor_loop"};
+        for(int i = 0; i < 2; ++i) {
+            glua::function<void(lua_Number)> loop = s[loops[i]];
+            auto start = std::chrono::steady_clock::now();
+            loop(lua_Number(iterations));
+            auto mid = std::chrono::steady_clock::now();
+            lua_getglobal(L, loops[i]);
+            lua_pushnumber(L, lua_Number(iterations));
+            lua_call(L, 1, 0);
+            auto end = std::chrono::steady_clock::now();
+            report(names[i], "glua", std::chrono::duration<double, std::nano>(mid - start).count() / iterations);
+            report(names[i], "raw", std::chrono::duration<double, std::nano>(end - mid).count() / iterations);
+        }
+    }
+
+    // Userdata
+    luaL_newmetatable(L, "point");
+    lua_pop(L, 1);
+    compare("userdata_push",
+        [&] { s["p"] = point{1, 2}; },
+        [&] {
+            point* p = static_cast<point*>(lua_newuserdata(L, sizeof(point)));
+            *p = point{1, 2};
+            luaL_setmetatable(L, "point");
+            lua_setglobal(L, "p");
+        });
+    compare("userdata_check",
+        [&] { sink_number = s["p"].get<point>().x; },
+        [&] {
+            lua_getglobal(L, "p");
+            sink_number = static_cast<point*>(luaL_checkudata(L, -1, "point"))->x;
+            lua_pop(L, 1);
+        });
+
+    // Strings
+    std::string str(64, 'x');
+    compare("string_push",
+        [&] { s["str"] = str; },
+        [&] { lua_pushlstring(L, str.data(), str.size()); lua_setglobal(L, "str"); });
+    compare("string_get",
+        [&] { sink_size = s["str"].get<std::string>().size(); },
+        [&] {
+            lua_getglobal(L, "str");
+            size_t len = 0;
+            const char* p = lua_tolstring(L, -1, &len);
+            sink_size = std::string(p, len).size();
+            lua_pop(L, 1);
+        });
+
+    // Tables
+    compare("table_set",
+        [&] { s["t"]["k"] = lua_Number(1); },
+        [&] {
+            lua_getglobal(L, "t");
+            lua_pushnumber(L, 1);
+            lua_setfield(L, -2, "k");
+            lua_pop(L, 1);
+        });
+    compare("table_get",
+        [&] { sink_number = s["t"]["k"]; },
+        [&] {
+            lua_getglobal(L, "t");
+            lua_getfield(L, -1, "k");
+            sink_number = lua_tonumber(L, -1);
+            lua_pop(L, 2);
+        });
+
+    lua_close(L);
+}
@@ -0,0 +1,432 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "api.hpp"
+#include "util/hash.hpp"
+#include "util/mapped_file.hpp"
+
+/**
+ * blob.hpp
+ * Contains glua::blob, an immutable, flat data format for large
+ * read-only lookup tables, and glua::blob_writer which builds one
+ * from a lua table.
+ *
+ * A blob is usually memory mapped from a file, so any number of
+ * states (and processes) share a single physical copy through the
+ * page cache. Pushing a std::shared_ptr<blob> into a state exposes
+ * its root as a userdata supporting indexing and the length operator;
+ * nested arrays and maps are exposed the same way, and scalars are
+ * converted to lua values on access.
+ *
+ * Layout (all values are native-endian, tags, counts and lengths
+ * are uint32, offsets are uint32 from the start of the blob, and all
+ * nodes are 4 byte aligned):
+ *
+ *   header  "GLUABLB1" version root
+ *   scalar  tag                       (nil, false, true)
+ *   number  tag double
+ *   integer tag int64
+ *   string  tag length bytes...
+ *   array   tag count offset[count]
+ *   map     tag count nbuckets {hash key value}[nbuckets]
+ *
+ * Maps use open addressing with linear probing on the FNV-1a hash of
+ * the key; an empty bucket has a key offset of 0.
+ *
+ * Numbers with the integer subtype (lua 5.3 and later) are stored as
+ * integers and come back as integers. Version 1 blobs, which predate
+ * the integer tag, are still read.
+ */
+
+namespace glua {
+namespace detail {
+
+enum _blob_tag : uint32_t {
+    _blob_nil     = 0,
+    _blob_false   = 1,
+    _blob_true    = 2,
+    _blob_number  = 3,
+    _blob_string  = 4,
+    _blob_array   = 5,
+    _blob_map     = 6,
+    _blob_integer = 7
+};
+
+constexpr char     _blob_magic[8]  = {'G', 'L', 'U', 'A', 'B', 'L', 'B', '1'};
+constexpr uint32_t _blob_version   = 2;
+constexpr uint32_t _blob_header    = 16;
+
+} // namespace detail
+
+/**
+ * Read-only view over blob data, either memory mapped from a file
+ * or borrowed from memory which outlives the blob.
+ */
+class blob {
+public:
+    static constexpr const char* metatable = "glua.blob";
+
+    /**
+     * Map a blob file.
+     */
+    static inline std::shared_ptr<blob> open(const std::string& filename) {
+        std::shared_ptr<detail::_mapped_file> file = std::make_shared<detail::_mapped_file>(filename);
+        return std::shared_ptr<blob>(new blob(file->data(), file->size(), file));
+    }
+
+    /**
+     * Wrap blob data already in memory (e.g. compiled into the binary).
+     * The memory must outlive the blob.
+     */
+    static inline std::shared_ptr<blob> fromMemory(const char* data, size_t size) {
+        return std::shared_ptr<blob>(new blob(data, size, nullptr));
+    }
+
+    const char* data() const { return base; }
+    size_t size() const { return len; }
+    uint32_t root() const { return rootOffset; }
+
+    /**
+     * Push the root value of b onto the stack.
+     */
+    static inline void push(lua_State& l, const std::shared_ptr<blob>& b) {
+        b->pushValue(l, b, b->rootOffset);
+    }
+
+private:
+    struct node {
+        std::shared_ptr<blob> owner;
+        uint32_t offset;
+    };
+
+    /**
+     * Push a userdata referring to the node at offset (which must
+     * be an array or map) onto the stack.
+     */
+    static inline void pushNode(lua_State& l, std::shared_ptr<blob> b, uint32_t offset) {
+        node* n = static_cast<node*>(lua_newuserdata(&l, sizeof(node)));
+        if(n == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+        new (n) node{std::move(b), offset};
+        if(luaL_newmetatable(&l, metatable)) {
+            lua_pushcfunction(&l, &l_index);
+            lua_setfield(&l, -2, "__index");
+            lua_pushcfunction(&l, &l_len);
+            lua_setfield(&l, -2, "__len");
+            lua_pushcfunction(&l, &l_gc);
+            lua_setfield(&l, -2, "__gc");
+        }
+        lua_setmetatable(&l, -2);
+    }
+
+    blob(const char* data, size_t size, std::shared_ptr<detail::_mapped_file> file)
+    : base(data), len(size), rootOffset(0), file(std::move(file))
+    {
+        uint32_t version = 0;
+        if(len < detail::_blob_header || std::memcmp(base, detail::_blob_magic, 8) != 0) {
+            throw std::runtime_error("Error: not a glua blob");
+        }
+        std::memcpy(&version, base + 8, 4);
+        std::memcpy(&rootOffset, base + 12, 4);
+        if(version < 1 || version > detail::_blob_version) throw std::runtime_error("Error: unsupported glua blob version");
+        if(!valid(rootOffset, 4)) throw std::runtime_error("Error: corrupt glua blob");
+    }
+
+    inline bool valid(uint32_t offset, size_t n) const {
+        return offset <= len && n <= len - offset;
+    }
+
+    /**
+     * Read a uint32 at offset; out-of-range reads yield 0 (nil).
+     */
+    inline uint32_t u32(uint32_t offset) const {
+        uint32_t v = 0;
+        if(valid(offset, 4)) std::memcpy(&v, base + offset, 4);
+        return v;
+    }
+
+    /**
+     * Push the value stored at offset onto the stack.
+     */
+    inline void pushValue(lua_State& l, const std::shared_ptr<blob>& self, uint32_t offset) const {
+        switch(u32(offset)) {
+        case detail::_blob_false: lua_pushboolean(&l, 0); break;
+        case detail::_blob_true:  lua_pushboolean(&l, 1); break;
+        case detail::_blob_number: {
+            lua_Number n = 0;
+            if(valid(offset + 4, sizeof(double))) {
+                double d;
+                std::memcpy(&d, base + offset + 4, sizeof(double));
+                n = static_cast<lua_Number>(d);
+            }
+            lua_pushnumber(&l, n);
+            break;
+        }
+        case detail::_blob_integer: {
+            int64_t i = 0;
+            if(valid(offset + 4, sizeof(int64_t))) std::memcpy(&i, base + offset + 4, sizeof(int64_t));
+            lua_pushinteger(&l, static_cast<lua_Integer>(i));
+            break;
+        }
+        case detail::_blob_string: {
+            uint32_t slen = u32(offset + 4);
+            if(valid(offset + 8, slen)) lua_pushlstring(&l, base + offset + 8, slen);
+            else                        lua_pushnil(&l);
+            break;
+        }
+        case detail::_blob_array:
+        case detail::_blob_map:
+            pushNode(l, self, offset);
+            break;
+        default:
+            lua_pushnil(&l);
+        }
+    }
+
+    /**
+     * Find the value offset for key in the map at offset,
+     * returning 0 if absent.
+     */
+    inline uint32_t find(uint32_t offset, const char* key, size_t klen) const {
+        uint32_t nbuckets = u32(offset + 8);
+        if(nbuckets == 0 || !valid(offset + 12, size_t(nbuckets) * 12)) return 0;
+        uint32_t hash = detail::_fnv1a(key, klen);
+        uint32_t mask = nbuckets - 1;
+        for(uint32_t i = 0; i < nbuckets; ++i) {
+            uint32_t bucket = offset + 12 + ((hash + i) & mask) * 12;
+            uint32_t koff = u32(bucket + 4);
+            if(koff == 0) return 0;
+            if(u32(bucket) != hash) continue;
+            uint32_t slen = u32(koff + 4);
+            if(slen == klen && valid(koff + 8, slen) && std::memcmp(base + koff + 8, key, klen) == 0) {
+                return u32(bucket + 8);
+            }
+        }
+        return 0;
+    }
+
+    static int l_index(lua_State* l) {
+        const node& n = *static_cast<node*>(luaL_checkudata(l, 1, metatable));
+        const blob& b = *n.owner;
+        if(b.u32(n.offset) == detail::_blob_array) {
+            int isnum = 0;
+            lua_Integer i = lua_tointegerx(l, 2, &isnum);
+            uint32_t count = b.u32(n.offset + 4);
+            if(!isnum || i < 1 || static_cast<lua_Unsigned>(i) > count) return 0;
+            b.pushValue(*l, n.owner, b.u32(n.offset + 8 + uint32_t(i - 1) * 4));
+            return 1;
+        }
+        if(lua_type(l, 2) != LUA_TSTRING) return 0;
+        size_t klen = 0;
+        const char* key = lua_tolstring(l, 2, &klen);
+        uint32_t value = b.find(n.offset, key, klen);
+        if(value == 0) return 0;
+        b.pushValue(*l, n.owner, value);
+        return 1;
+    }
+
+    static int l_len(lua_State* l) {
+        const node& n = *static_cast<node*>(luaL_checkudata(l, 1, metatable));
+        lua_pushinteger(l, static_cast<lua_Integer>(n.owner->u32(n.offset + 4)));
+        return 1;
+    }
+
+    static int l_gc(lua_State* l) {
+        static_cast<node*>(lua_touserdata(l, 1))->~node();
+        return 0;
+    }
+
+    const char* base;
+    size_t len;
+    uint32_t rootOffset;
+    std::shared_ptr<detail::_mapped_file> file;
+};
+
+/**
+ * Builds blob data from a lua value. Tables whose keys are exactly
+ * 1..n become arrays, any other table must have only string keys and
+ * becomes a map. Identical strings are stored once.
+ */
+class blob_writer {
+public:
+    /**
+     * Serialize the value at index.
+     */
+    static inline std::string build(lua_State& l, int index) {
+        blob_writer w;
+        w.out.append(detail::_blob_magic, 8);
+        w.put(detail::_blob_version);
+        w.put(uint32_t(0));
+        uint32_t root = w.write(l, lua_absindex(&l, index), 0);
+        std::memcpy(&w.out[12], &root, 4);
+        return std::move(w.out);
+    }
+
+    /**
+     * Serialize the value at index into a file.
+     */
+    static inline void write(lua_State& l, int index, const std::string& filename) {
+        std::string data = build(l, index);
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if(!file.write(data.data(), data.size())) throw std::runtime_error("Error: couldn't write " + filename);
+    }
+
+private:
+    static constexpr int max_depth = 64;
+
+    std::string out;
+    std::unordered_map<std::string, uint32_t> strings;
+
+    inline void put(uint32_t v) {
+        out.append(reinterpret_cast<const char*>(&v), 4);
+    }
+
+    inline uint32_t here() const {
+        if(out.size() > UINT32_MAX) throw std::runtime_error("Error: glua blob exceeds 4GB");
+        return static_cast<uint32_t>(out.size());
+    }
+
+    inline void align() {
+        out.append((4 - out.size() % 4) % 4, '\0');
+    }
+
+    inline uint32_t writeString(const char* str, size_t len) {
+        std::string key(str, len);
+        auto it = strings.find(key);
+        if(it != strings.end()) return it->second;
+        uint32_t offset = here();
+        put(detail::_blob_string);
+        put(static_cast<uint32_t>(len));
+        out.append(str, len);
+        align();
+        strings.emplace(std::move(key), offset);
+        return offset;
+    }
+
+    inline uint32_t write(lua_State& l, int index, int depth) {
+        uint32_t offset = here();
+        switch(lua_type(&l, index)) {
+        case LUA_TNIL:
+            put(detail::_blob_nil);
+            return offset;
+        case LUA_TBOOLEAN:
+            put(lua_toboolean(&l, index) ? detail::_blob_true : detail::_blob_false);
+            return offset;
+        case LUA_TNUMBER: {
+            if(detail::_is_integer(&l, index)) {
+                int64_t i = static_cast<int64_t>(lua_tointeger(&l, index));
+                put(detail::_blob_integer);
+                out.append(reinterpret_cast<const char*>(&i), sizeof(int64_t));
+                return offset;
+            }
+            double d = static_cast<double>(lua_tonumber(&l, index));
+            put(detail::_blob_number);
+            out.append(reinterpret_cast<const char*>(&d), sizeof(double));
+            return offset;
+        }
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char* str = lua_tolstring(&l, index, &len);
+            return writeString(str, len);
+        }
+        case LUA_TTABLE:
+            if(depth >= max_depth) throw std::runtime_error("Error: table nesting too deep for glua blob");
+            return writeTable(l, index, depth);
+        default:
+            throw std::runtime_error(std::string("Error: can't store a ") + luaL_typename(&l, index) + " in a glua blob");
+        }
+    }
+
+    inline uint32_t writeTable(lua_State& l, int index, int depth) {
+        luaL_checkstack(&l, 3, "glua blob");
+        size_t n = lua_rawlen(&l, index);
+        size_t count = 0;
+        bool array = true;
+        lua_pushnil(&l);
+        while(lua_next(&l, index)) {
+            ++count;
+            if(array) {
+                int isnum = 0;
+                lua_Integer i = lua_tointegerx(&l, -2, &isnum);
+                array = lua_type(&l, -2) == LUA_TNUMBER && isnum && i >= 1 && size_t(i) <= n;
+            }
+            lua_pop(&l, 1);
+        }
+        array = array && count == n;
+
+        std::vector<uint32_t> values;
+        values.reserve(count);
+        if(array) {
+            for(size_t i = 1; i <= n; ++i) {
+                lua_rawgeti(&l, index, static_cast<int>(i));
+                values.push_back(write(l, lua_gettop(&l), depth + 1));
+                lua_pop(&l, 1);
+            }
+            uint32_t offset = here();
+            put(detail::_blob_array);
+            put(static_cast<uint32_t>(n));
+            for(uint32_t v : values) put(v);
+            return offset;
+        }
+
+        std::vector<uint32_t> keys, hashes;
+        keys.reserve(count);
+        hashes.reserve(count);
+        lua_pushnil(&l);
+        while(lua_next(&l, index)) {
+            if(lua_type(&l, -2) != LUA_TSTRING) {
+                lua_pop(&l, 2);
+                throw std::runtime_error("Error: glua blob maps only support string keys");
+            }
+            size_t klen = 0;
+            const char* key = lua_tolstring(&l, -2, &klen);
+            hashes.push_back(detail::_fnv1a(key, klen));
+            keys.push_back(writeString(key, klen));
+            values.push_back(write(l, lua_gettop(&l), depth + 1));
+            lua_pop(&l, 1);
+        }
+
+        uint32_t nbuckets = 1;
+        while(nbuckets < count * 2) nbuckets <<= 1;
+        std::vector<uint32_t> buckets(size_t(nbuckets) * 3, 0);
+        for(size_t i = 0; i < keys.size(); ++i) {
+            uint32_t slot = hashes[i] & (nbuckets - 1);
+            while(buckets[slot * 3 + 1] != 0) slot = (slot + 1) & (nbuckets - 1);
+            buckets[slot * 3]     = hashes[i];
+            buckets[slot * 3 + 1] = keys[i];
+            buckets[slot * 3 + 2] = values[i];
+        }
+
+        uint32_t offset = here();
+        put(detail::_blob_map);
+        put(static_cast<uint32_t>(count));
+        put(nbuckets);
+        for(uint32_t v : buckets) put(v);
+        return offset;
+    }
+};
+
+namespace api {
+namespace detail {
+
+/**
+ * Push implementation for blobs, pushing the root value.
+ */
+template<>
+struct _push_impl<std::shared_ptr<blob>> {
+    inline static void push(lua_State& l, std::shared_ptr<blob> b) {
+        blob::push(l, b);
+    }
+};
+
+} // namespace detail
+} // namespace api
+
+} // namespace glua
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <chrono>
+
+#include "api.hpp"
+#include "error.hpp"
+#include "hooks.hpp"
+
+/**
+ * budget.hpp
+ * Execution budgets for lua calls. A budget limits a call to a
+ * number of lua instructions, a wall-clock deadline, or both; it is
+ * enforced by a count hook which checks the limits every
+ * checkInterval instructions, so the cost while running is one hook
+ * call per interval and nothing at all outside budgeted calls.
+ *
+ * When a budget runs out the call is aborted with a lua error, which
+ * pcall in the script can't stop, and api::call throws
+ * glua::budget_exceeded. A coroutine resumed with
+ * api::resume can instead be asked to yield when its budget runs out,
+ * so it can be continued later.
+ *
+ * LuaJIT doesn't run hooks in JIT-compiled code, so there budgets
+ * only bound interpreted code; call jit.off() in scripts that must
+ * stay within theirs.
+ */
+
+namespace glua {
+
+/**
+ * Thrown when a budgeted call exceeds its budget.
+ */
+class budget_exceeded : public error {
+public:
+    budget_exceeded() : error("lua execution budget exceeded", "", LUA_ERRRUN) {}
+};
+
+struct budget {
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * Maximum number of instructions; 0 means unlimited.
+     */
+    long instructions = 0;
+
+    /**
+     * Deadline; the default (epoch) means none.
+     */
+    clock::time_point deadline;
+
+    /**
+     * When resuming a coroutine, yield instead of aborting.
+     * Ignored under LuaJIT, where hooks can't yield.
+     */
+    bool yield = false;
+
+    /**
+     * Number of instructions between limit checks.
+     */
+    int checkInterval = 1000;
+
+    static inline budget steps(long n) {
+        budget b;
+        b.instructions = n;
+        if(n < b.checkInterval) b.checkInterval = static_cast<int>(n > 0 ? n : 1);
+        return b;
+    }
+
+    template<typename Rep, typename Period>
+    static inline budget timeout(std::chrono::duration<Rep, Period> d) {
+        budget b;
+        b.deadline = clock::now() + std::chrono::duration_cast<clock::duration>(d);
+        return b;
+    }
+
+    inline bool hasDeadline() const {
+        return deadline != clock::time_point();
+    }
+};
+
+namespace detail {
+
+/**
+ * Error object raised when a budget runs out. A lightuserdata no
+ * script can create, so it can't be confused with another error.
+ */
+inline void* _budget_error_key() {
+    static const char key = 0;
+    return const_cast<char*>(&key);
+}
+
+/**
+ * State of a budget during one call.
+ */
+struct _budget_run {
+    explicit _budget_run(const budget& limits)
+    : limits(limits), used(0), exceeded(false), hook(0), interval(limits.checkInterval < 1 ? 1 : limits.checkInterval) {
+        if(limits.instructions > 0 && limits.instructions < interval) interval = static_cast<int>(limits.instructions);
+    }
+
+    const budget& limits;
+    long used;
+    bool exceeded;
+    int hook;
+
+    /**
+     * checkInterval, but no more than the instruction limit.
+     */
+    int interval;
+
+    /**
+     * Once the budget has run out the error is raised again on every
+     * instruction, so a pcall in the script can't swallow it: the
+     * first instruction after the pcall returns raises it once more.
+     */
+    static bool check(lua_State* l, void* ctx) {
+        _budget_run& run = *static_cast<_budget_run*>(ctx);
+        if(!run.exceeded) {
+            run.used += run.interval;
+            bool over = (run.limits.instructions > 0 && run.used >= run.limits.instructions) ||
+                        (run.limits.hasDeadline() && budget::clock::now() >= run.limits.deadline);
+            if(!over) return false;
+            run.exceeded = true;
+#ifndef GLUA_LUAJIT
+            // lua_pushthread returns 1 on the main thread, which can't yield
+            bool main = lua_pushthread(l) == 1;
+            lua_pop(l, 1);
+            if(run.limits.yield && !main) return true;
+#endif
+            _hooks::setInterval(*l, run.hook, 1);
+        }
+        lua_pushlightuserdata(l, _budget_error_key());
+        lua_error(l);
+        return false;
+    }
+};
+
+/**
+ * Registers a budget with the hook dispatcher for its lifetime.
+ */
+class _budget_scope {
+public:
+    _budget_scope(lua_State& l, _budget_run& run)
+    : l(l), id(_hooks::add(l, &_budget_run::check, &run, run.interval)) {
+        run.hook = id;
+    }
+
+    ~_budget_scope() {
+        _hooks::remove(l, id);
+    }
+
+private:
+    lua_State& l;
+    int id;
+};
+
+/**
+ * Pop the error object of a failed budgeted call and throw.
+ */
+[[noreturn]] inline void _throw_budget_error(lua_State& l, int status, const _budget_run& run) {
+    if(run.exceeded) {
+        lua_pop(&l, 1);
+        throw budget_exceeded();
+    }
+    _throw_error(l, status);
+}
+
+} // namespace detail
+
+namespace api {
+
+/**
+ * Execute a lua object on the stack within a budget. The call is
+ * protected like api::call; running out of budget throws
+ * budget_exceeded, other errors throw the matching glua::error.
+ */
+inline void call(lua_State& l, int nargs, int nret, const budget& b) {
+    ::glua::detail::_budget_run run(b);
+    int status;
+    {
+        ::glua::detail::_budget_scope scope(l, run);
+        status = ::glua::detail::_pcall(l, nargs, nret);
+    }
+    if(status != LUA_OK) ::glua::detail::_throw_budget_error(l, status, run);
+}
+
+/**
+ * Resume the coroutine co within a budget. Returns LUA_OK if the
+ * coroutine finished and LUA_YIELD if it yielded, either by itself
+ * or because the budget ran out with budget::yield set.
+ */
+inline int resume(lua_State& co, lua_State* from, int nargs, const budget& b) {
+    ::glua::detail::_budget_run run(b);
+    int status;
+    int nresults = 0;
+    {
+        ::glua::detail::_budget_scope scope(co, run);
+        status = ::glua::detail::_resume(&co, from, nargs, &nresults);
+    }
+    if(status != LUA_OK && status != LUA_YIELD) ::glua::detail::_throw_budget_error(co, status, run);
+    return status;
+}
+
+/**
+ * Load and run a string as a lua chunk within a budget.
+ */
+inline void loadString(lua_State& l, const char* chunk, const budget& b) {
+    int status = luaL_loadstring(&l, chunk);
+    if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+    call(l, 0, LUA_MULTRET, b);
+}
+
+} // namespace api
+} // namespace glua
@@ -0,0 +1,370 @@
+#pragma once
+
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "api.hpp"
+#include "cfunction.hpp"
+
+/**
+ * buffer.hpp
+ * Contains glua::buffer, a growable byte buffer for building large
+ * strings (HTML, CSV, ...) without concatenating lua strings. Each
+ * `..` of lua strings creates and hashes a new intermediate string,
+ * making a loop of them quadratic; appending to a buffer is amortized
+ * linear, and C++ takes the finished bytes by move (or looks at them
+ * through a view) instead of copying them out of a lua string.
+ *
+ * A buffer is shared through a std::shared_ptr; pushing that pointer
+ * into a state exposes it to scripts as a userdata with the methods
+ * append, appendf, reserve, size, clear, tostring and take:
+ *
+ *   local out = buffer(4096)
+ *   for _, row in ipairs(rows) do
+ *       out:appendf("%s,%d\n", row.name, row.count)
+ *   end
+ *
+ *   auto out = s["out"].get<std::shared_ptr<glua::buffer>>();
+ *   std::string csv = out->take();
+ *
+ * append takes strings, numbers and other buffers and returns the
+ * buffer, so calls can be chained; appendf formats like string.format.
+ * # gives the size and tostring the contents.
+ */
+
+namespace glua {
+
+class buffer {
+public:
+    static constexpr const char* metatable = "glua.buffer";
+
+    buffer() {}
+    explicit buffer(size_t capacity) {
+        bytes.reserve(capacity);
+    }
+
+    inline buffer& append(const char* data, size_t len) {
+        bytes.append(data, len);
+        return *this;
+    }
+
+    inline buffer& append(const std::string& str) {
+        bytes.append(str);
+        return *this;
+    }
+
+#ifdef GLUA_STRING_VIEW
+    inline buffer& append(std::string_view str) {
+        bytes.append(str.data(), str.size());
+        return *this;
+    }
+#endif
+
+    inline buffer& append(const char* str) {
+        bytes.append(str);
+        return *this;
+    }
+
+    /**
+     * Append printf style formatted output.
+     */
+#if defined(__GNUC__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    inline buffer& appendf(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        try {
+            vappendf(fmt, args);
+        } catch(...) {
+            va_end(args);
+            throw;
+        }
+        va_end(args);
+        return *this;
+    }
+
+    /**
+     * Format into a small stack buffer first, so short output is
+     * formatted once and nothing beyond it is touched; longer output
+     * is formatted again straight into the grown buffer.
+     */
+    inline buffer& vappendf(const char* fmt, va_list args) {
+        char tmp[256];
+        va_list again;
+        va_copy(again, args);
+        int n = std::vsnprintf(tmp, sizeof(tmp), fmt, args);
+        if(n < 0) {
+            va_end(again);
+            throw std::runtime_error("Error: invalid format string");
+        }
+        if(static_cast<size_t>(n) < sizeof(tmp)) {
+            va_end(again);
+            bytes.append(tmp, static_cast<size_t>(n));
+            return *this;
+        }
+        size_t used = bytes.size();
+        try {
+            bytes.resize(used + static_cast<size_t>(n));
+        } catch(...) {
+            va_end(again);
+            throw;
+        }
+        std::vsnprintf(&bytes[used], static_cast<size_t>(n) + 1, fmt, again);
+        va_end(again);
+        return *this;
+    }
+
+    inline void reserve(size_t capacity) {
+        bytes.reserve(capacity);
+    }
+
+    inline void clear() {
+        bytes.clear();
+    }
+
+    inline size_t size() const { return bytes.size(); }
+    inline size_t capacity() const { return bytes.capacity(); }
+    inline const char* data() const { return bytes.data(); }
+
+    /**
+     * The contents, which stay in the buffer.
+     */
+    inline const std::string& str() const {
+        return bytes;
+    }
+
+#ifdef GLUA_STRING_VIEW
+    /**
+     * A view of the contents, valid until the buffer next changes.
+     */
+    inline std::string_view view() const {
+        return std::string_view(bytes.data(), bytes.size());
+    }
+#endif
+
+    /**
+     * Move the contents out, leaving the buffer empty.
+     */
+    inline std::string take() {
+        std::string out;
+        out.swap(bytes);
+        return out;
+    }
+
+    /**
+     * Push a lua userdata referring to b onto the stack.
+     */
+    static inline void push(lua_State& l, std::shared_ptr<buffer> b) {
+        using holder = std::shared_ptr<buffer>;
+        holder* h = static_cast<holder*>(lua_newuserdata(&l, sizeof(holder)));
+        if(h == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+        new (h) holder(std::move(b));
+        if(luaL_newmetatable(&l, metatable)) {
+            static const luaL_Reg methods[] = {
+                {"append",   &detail::_protect<&l_append>},
+                {"reserve",  &detail::_protect<&l_reserve>},
+                {"size",     &l_size},
+                {"clear",    &l_clear},
+                {"tostring", &l_tostring},
+                {"take",     &l_take},
+                {nullptr,    nullptr}
+            };
+            lua_newtable(&l);
+            luaL_setfuncs(&l, methods, 0);
+            lua_pushnil(&l);
+            lua_pushcclosure(&l, &detail::_protect<&l_appendf>, 1);
+            lua_setfield(&l, -2, "appendf");
+            lua_setfield(&l, -2, "__index");
+            lua_pushcfunction(&l, &l_size);
+            lua_setfield(&l, -2, "__len");
+            lua_pushcfunction(&l, &l_tostring);
+            lua_setfield(&l, -2, "__tostring");
+            lua_pushcfunction(&l, &l_gc);
+            lua_setfield(&l, -2, "__gc");
+        }
+        lua_setmetatable(&l, -2);
+    }
+
+    /**
+     * Get the buffer referred to by the userdata at index.
+     */
+    static inline std::shared_ptr<buffer> get(lua_State& l, int index) {
+        return *static_cast<std::shared_ptr<buffer>*>(luaL_checkudata(&l, index, metatable));
+    }
+
+    /**
+     * If the value at index is a buffer, return it, otherwise nullptr.
+     */
+    static inline buffer* test(lua_State& l, int index) {
+        void* h = luaL_testudata(&l, index, metatable);
+        return h == nullptr ? nullptr : static_cast<std::shared_ptr<buffer>*>(h)->get();
+    }
+
+    /**
+     * Set the global name to a function creating a new buffer, with
+     * an optional initial capacity.
+     */
+    static inline void expose(lua_State& l, const char* name) {
+        lua_pushcfunction(&l, &detail::_protect<&l_new>);
+        lua_setglobal(&l, name);
+    }
+
+private:
+    static inline buffer& self(lua_State* l) {
+        return **static_cast<std::shared_ptr<buffer>*>(luaL_checkudata(l, 1, metatable));
+    }
+
+    /**
+     * Raise an error if the capacity argument at index is negative.
+     */
+    static inline size_t checkCapacity(lua_State* l, int index) {
+        lua_Integer n = luaL_optinteger(l, index, 0);
+        luaL_argcheck(l, n >= 0, index, "negative capacity");
+        return static_cast<size_t>(n);
+    }
+
+    static int l_new(lua_State* l) {
+        size_t capacity = checkCapacity(l, 1);
+        push(*l, std::make_shared<buffer>(capacity));
+        return 1;
+    }
+
+    /**
+     * Append each argument, checking all of them first so an invalid
+     * one leaves the buffer unchanged.
+     */
+    static int l_append(lua_State* l) {
+        buffer& b = self(l);
+        int top = lua_gettop(l);
+        for(int i = 2; i <= top; ++i) {
+            int type = lua_type(l, i);
+            if(type != LUA_TSTRING && type != LUA_TNUMBER && test(*l, i) == nullptr) {
+                return luaL_argerror(l, i, "string, number or buffer expected");
+            }
+        }
+        for(int i = 2; i <= top; ++i) {
+            buffer* other = test(*l, i);
+            if(other != nullptr) {
+                b.bytes.append(other->bytes);
+            } else {
+                size_t len = 0;
+                const char* str = lua_tolstring(l, i, &len);
+                b.bytes.append(str, len);
+            }
+        }
+        lua_settop(l, 1);
+        return 1;
+    }
+
+    /**
+     * Format the arguments with string.format and append the result.
+     * format is taken from the loaded string library, not the global,
+     * on the first call and kept in the upvalue.
+     */
+    static int l_appendf(lua_State* l) {
+        self(l);
+        int top = lua_gettop(l);
+        if(lua_isnil(l, lua_upvalueindex(1))) {
+            lua_getfield(l, LUA_REGISTRYINDEX, "_LOADED");
+            if(lua_istable(l, -1)) {
+                lua_getfield(l, -1, "string");
+                if(lua_istable(l, -1)) lua_getfield(l, -1, "format");
+            }
+            if(!lua_isfunction(l, -1)) return luaL_error(l, "appendf requires the string library");
+            lua_replace(l, lua_upvalueindex(1));
+            lua_settop(l, top);
+        }
+        lua_pushvalue(l, lua_upvalueindex(1));
+        lua_insert(l, 2);
+        lua_call(l, top - 1, 1);
+        size_t len = 0;
+        const char* str = lua_tolstring(l, -1, &len);
+        self(l).bytes.append(str, len);
+        lua_settop(l, 1);
+        return 1;
+    }
+
+    static int l_reserve(lua_State* l) {
+        self(l).bytes.reserve(checkCapacity(l, 2));
+        lua_settop(l, 1);
+        return 1;
+    }
+
+    static int l_size(lua_State* l) {
+        lua_pushinteger(l, static_cast<lua_Integer>(self(l).bytes.size()));
+        return 1;
+    }
+
+    static int l_clear(lua_State* l) {
+        self(l).bytes.clear();
+        lua_settop(l, 1);
+        return 1;
+    }
+
+    static int l_tostring(lua_State* l) {
+        const std::string& bytes = self(l).bytes;
+        lua_pushlstring(l, bytes.data(), bytes.size());
+        return 1;
+    }
+
+    /**
+     * Return the contents and empty the buffer, releasing its memory.
+     */
+    static int l_take(lua_State* l) {
+        buffer& b = self(l);
+        lua_pushlstring(l, b.bytes.data(), b.bytes.size());
+        std::string().swap(b.bytes);
+        return 1;
+    }
+
+    static int l_gc(lua_State* l) {
+        using holder = std::shared_ptr<buffer>;
+        static_cast<holder*>(lua_touserdata(l, 1))->~holder();
+        return 0;
+    }
+
+    std::string bytes;
+};
+
+namespace api {
+namespace detail {
+
+/**
+ * Push implementation for shared buffers.
+ */
+template<>
+struct _push_impl<std::shared_ptr<buffer>> {
+    inline static void push(lua_State& l, std::shared_ptr<buffer> b) {
+        buffer::push(l, std::move(b));
+    }
+};
+
+/**
+ * Get implementation for shared buffers.
+ */
+template<>
+struct _check_get_impl<std::shared_ptr<buffer>> {
+    inline static std::shared_ptr<buffer> get(lua_State& l, int index) {
+        return buffer::get(l, index);
+    }
+};
+
+/**
+ * Argument implementation for shared buffers.
+ */
+template<>
+struct _arg_impl<std::shared_ptr<buffer>> {
+    inline static std::shared_ptr<buffer> get(lua_State& l, int index) {
+        if(buffer::test(l, index) == nullptr) _arg_error(l, index, "buffer");
+        return *static_cast<std::shared_ptr<buffer>*>(lua_touserdata(&l, index));
+    }
+};
+
+} // namespace detail
+} // namespace api
+
+} // namespace glua
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "api.hpp"
+#include "util/hash.hpp"
+#include "util/mapped_file.hpp"
+
+/**
+ * bundle.hpp
+ * Contains glua::bundle, a single file or byte array holding many
+ * lua modules with an index by module name, and glua::bundle_writer
+ * which builds one.
+ *
+ * Installing a bundle into a state adds a searcher to
+ * package.searchers, ahead of the file searchers, which resolves
+ * require from the bundle: the chunk is loaded straight out of the
+ * mapped file or the array with luaL_loadbuffer, without any file
+ * I/O or copying.
+ *
+ * Modules are normally stored as bytecode, which is specific to the
+ * lua version (and, for LuaJIT, the architecture) that produced it;
+ * build bundles with the same lua the program links against, or
+ * store sources instead.
+ *
+ * Layout (native-endian uint32 offsets from the start of the bundle,
+ * 4 byte aligned):
+ *
+ *   header  "GLUABND1" version count nbuckets
+ *   index   {hash name chunk}[nbuckets]
+ *   name    length bytes...
+ *   chunk   length bytes...
+ *
+ * The index uses open addressing with linear probing on the FNV-1a
+ * hash of the module name; an empty bucket has a name offset of 0.
+ */
+
+namespace glua {
+namespace detail {
+
+constexpr char     _bundle_magic[8] = {'G', 'L', 'U', 'A', 'B', 'N', 'D', '1'};
+constexpr uint32_t _bundle_version  = 1;
+constexpr uint32_t _bundle_header   = 20;
+
+} // namespace detail
+
+class bundle {
+public:
+    static constexpr const char* metatable = "glua.bundle";
+
+    /**
+     * Map a bundle file.
+     */
+    static inline std::shared_ptr<bundle> open(const std::string& filename) {
+        std::shared_ptr<detail::_mapped_file> file = std::make_shared<detail::_mapped_file>(filename);
+        return std::shared_ptr<bundle>(new bundle(file->data(), file->size(), file));
+    }
+
+    /**
+     * Wrap bundle data already in memory (e.g. compiled into the
+     * binary). The memory must outlive the bundle.
+     */
+    static inline std::shared_ptr<bundle> fromMemory(const char* data, size_t size) {
+        return std::shared_ptr<bundle>(new bundle(data, size, nullptr));
+    }
+
+    /**
+     * Number of modules in the bundle.
+     */
+    inline uint32_t size() const { return count; }
+
+    /**
+     * Find the chunk of module name. Returns false if the bundle
+     * doesn't contain it.
+     */
+    inline bool find(const char* name, size_t nlen, const char*& chunk, size_t& clen) const {
+        if(nbuckets == 0) return false;
+        uint32_t hash = detail::_fnv1a(name, nlen);
+        uint32_t mask = nbuckets - 1;
+        for(uint32_t i = 0; i < nbuckets; ++i) {
+            uint32_t bucket = detail::_bundle_header + ((hash + i) & mask) * 12;
+            uint32_t noff = u32(bucket + 4);
+            if(noff == 0) return false;
+            if(u32(bucket) != hash || u32(noff) != nlen || !valid(noff + 4, nlen)) continue;
+            if(std::memcmp(base + noff + 4, name, nlen) != 0) continue;
+            uint32_t coff = u32(bucket + 8);
+            uint32_t n = u32(coff);
+            if(!valid(coff + 4, n)) return false;
+            chunk = base + coff + 4;
+            clen = n;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Add a searcher for b to package.searchers of l, after the
+     * preload searcher and before the file searchers. Requires the
+     * package library.
+     */
+    static inline void install(lua_State& l, std::shared_ptr<bundle> b) {
+        lua_getglobal(&l, "package");
+        if(lua_type(&l, -1) == LUA_TTABLE) lua_getfield(&l, -1, detail::_searchers_field);
+        else                               lua_pushnil(&l);
+        if(lua_type(&l, -1) != LUA_TTABLE) {
+            lua_pop(&l, 2);
+            throw std::runtime_error("Error: glua bundles require the package library");
+        }
+        int searchers = lua_gettop(&l);
+
+        using holder = std::shared_ptr<bundle>;
+        holder* h = static_cast<holder*>(lua_newuserdata(&l, sizeof(holder)));
+        if(h == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+        new (h) holder(std::move(b));
+        if(luaL_newmetatable(&l, metatable)) {
+            lua_pushcfunction(&l, &l_gc);
+            lua_setfield(&l, -2, "__gc");
+        }
+        lua_setmetatable(&l, -2);
+        lua_pushcclosure(&l, &l_search, 1);
+
+        // Shift the searchers from position 2 on up by one
+        int n = static_cast<int>(lua_rawlen(&l, searchers));
+        for(int i = n; i >= 2; --i) {
+            lua_rawgeti(&l, searchers, i);
+            lua_rawseti(&l, searchers, i + 1);
+        }
+        lua_rawseti(&l, searchers, n >= 1 ? 2 : 1);
+        lua_pop(&l, 2);
+    }
+
+private:
+    bundle(const char* data, size_t size, std::shared_ptr<detail::_mapped_file> file)
+    : base(data), len(size), count(0), nbuckets(0), file(std::move(file))
+    {
+        uint32_t version = 0;
+        if(len < detail::_bundle_header || std::memcmp(base, detail::_bundle_magic, 8) != 0) {
+            throw std::runtime_error("Error: not a glua bundle");
+        }
+        std::memcpy(&version, base + 8, 4);
+        std::memcpy(&count, base + 12, 4);
+        std::memcpy(&nbuckets, base + 16, 4);
+        if(version != detail::_bundle_version) throw std::runtime_error("Error: unsupported glua bundle version");
+        if((nbuckets & (nbuckets - 1)) != 0 || !valid(detail::_bundle_header, size_t(nbuckets) * 12)) {
+            throw std::runtime_error("Error: corrupt glua bundle");
+        }
+    }
+
+    inline bool valid(uint32_t offset, size_t n) const {
+        return offset <= len && n <= len - offset;
+    }
+
+    inline uint32_t u32(uint32_t offset) const {
+        uint32_t v = 0;
+        if(valid(offset, 4)) std::memcpy(&v, base + offset, 4);
+        return v;
+    }
+
+    /**
+     * The searcher: returns a loader for the module named by
+     * argument 1, or a message saying why there is none.
+     */
+    static int l_search(lua_State* l) {
+        size_t nlen = 0;
+        const char* name = luaL_checklstring(l, 1, &nlen);
+        const bundle& b = **static_cast<std::shared_ptr<bundle>*>(lua_touserdata(l, lua_upvalueindex(1)));
+        const char* chunk = nullptr;
+        size_t clen = 0;
+        if(!b.find(name, nlen, chunk, clen)) {
+            lua_pushfstring(l, "\n\tno module '%s' in bundle", name);
+            return 1;
+        }
+        const char* chunkname = lua_pushfstring(l, "=%s", name);
+        if(luaL_loadbuffer(l, chunk, clen, chunkname) != LUA_OK) {
+            return luaL_error(l, "error loading module '%s' from bundle:\n\t%s", name, lua_tostring(l, -1));
+        }
+        lua_pushliteral(l, ":bundle:");
+        return 2;
+    }
+
+    static int l_gc(lua_State* l) {
+        using holder = std::shared_ptr<bundle>;
+        static_cast<holder*>(lua_touserdata(l, 1))->~holder();
+        return 0;
+    }
+
+    const char* base;
+    size_t len;
+    uint32_t count;
+    uint32_t nbuckets;
+    std::shared_ptr<detail::_mapped_file> file;
+};
+
+/**
+ * Builds a bundle from module sources. Sources are compiled with the
+ * given state and stored as bytecode unless precompile is false.
+ */
+class bundle_writer {
+public:
+    explicit bundle_writer(lua_State& l, bool precompile = true, bool strip = false)
+    : l(l), precompile(precompile), strip(strip) {}
+
+    /**
+     * Add module name with the given source. Throws a
+     * glua::syntax_error if it doesn't compile.
+     */
+    inline void add(const std::string& name, const std::string& source) {
+        std::string chunkname = "=" + name;
+        int status = luaL_loadbuffer(&l, source.data(), source.size(), chunkname.c_str());
+        if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+        if(!precompile) {
+            lua_pop(&l, 1);
+            modules.emplace_back(name, source);
+            return;
+        }
+        std::string code;
+        ::glua::detail::_dump(&l, &writeChunk, &code, strip);
+        lua_pop(&l, 1);
+        modules.emplace_back(name, std::move(code));
+    }
+
+    /**
+     * Add module name from a source file.
+     */
+    inline void addFile(const std::string& name, const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        if(!file) throw std::runtime_error("Error: couldn't open " + filename);
+        std::ostringstream source;
+        source << file.rdbuf();
+        add(name, source.str());
+    }
+
+    /**
+     * The bundle data.
+     */
+    inline std::string build() const {
+        uint32_t count = static_cast<uint32_t>(modules.size());
+        uint32_t nbuckets = 1;
+        while(nbuckets < count * 2) nbuckets <<= 1;
+
+        std::string out(detail::_bundle_magic, 8);
+        put(out, detail::_bundle_version);
+        put(out, count);
+        put(out, nbuckets);
+        std::vector<uint32_t> buckets(size_t(nbuckets) * 3, 0);
+        out.append(buckets.size() * 4, '\0');
+
+        for(const auto& m : modules) {
+            uint32_t noff = here(out);
+            put(out, static_cast<uint32_t>(m.first.size()));
+            out.append(m.first);
+            align(out);
+            uint32_t coff = here(out);
+            put(out, static_cast<uint32_t>(m.second.size()));
+            out.append(m.second);
+            align(out);
+
+            uint32_t hash = detail::_fnv1a(m.first.data(), m.first.size());
+            uint32_t slot = hash & (nbuckets - 1);
+            while(buckets[slot * 3 + 1] != 0) {
+                if(out.compare(buckets[slot * 3 + 1] + 4, m.first.size(), m.first) == 0 &&
+                   getU32(out, buckets[slot * 3 + 1]) == m.first.size()) {
+                    throw std::runtime_error("Error: duplicate module " + m.first + " in glua bundle");
+                }
+                slot = (slot + 1) & (nbuckets - 1);
+            }
+            buckets[slot * 3]     = hash;
+            buckets[slot * 3 + 1] = noff;
+            buckets[slot * 3 + 2] = coff;
+        }
+        std::memcpy(&out[detail::_bundle_header], buckets.data(), buckets.size() * 4);
+        return out;
+    }
+
+    /**
+     * Write the bundle to a file.
+     */
+    inline void write(const std::string& filename) const {
+        std::string data = build();
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if(!file.write(data.data(), data.size())) throw std::runtime_error("Error: couldn't write " + filename);
+    }
+
+    /**
+     * Write the bundle as a C++ array definition named symbol, with
+     * symbol_size holding its length, for use with bundle::fromMemory.
+     */
+    inline void writeSource(std::ostream& os, const std::string& symbol) const {
+        std::string data = build();
+        os << "extern const char " << symbol << "[];\n"
+           << "extern const unsigned long " << symbol << "_size;\n"
+           << "const char " << symbol << "[] = {";
+        for(size_t i = 0; i < data.size(); ++i) {
+            if(i % 16 == 0) os << "\n   ";
+            os << ' ' << static_cast<int>(static_cast<signed char>(data[i])) << ',';
+        }
+        os << "\n};\n"
+           << "const unsigned long " << symbol << "_size = " << data.size() << ";\n";
+    }
+
+private:
+    static int writeChunk(lua_State*, const void* p, size_t sz, void* ud) {
+        static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+        return 0;
+    }
+
+    static inline void put(std::string& out, uint32_t v) {
+        out.append(reinterpret_cast<const char*>(&v), 4);
+    }
+
+    static inline uint32_t getU32(const std::string& out, uint32_t offset) {
+        uint32_t v;
+        std::memcpy(&v, out.data() + offset, 4);
+        return v;
+    }
+
+    static inline uint32_t here(const std::string& out) {
+        if(out.size() > UINT32_MAX) throw std::runtime_error("Error: glua bundle exceeds 4GB");
+        return static_cast<uint32_t>(out.size());
+    }
+
+    static inline void align(std::string& out) {
+        out.append((4 - out.size() % 4) % 4, '\0');
+    }
+
+    lua_State& l;
+    bool precompile;
+    bool strip;
+    std::vector<std::pair<std::string, std::string>> modules;
+};
+
+} // namespace glua
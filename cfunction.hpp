@@ -1,8 +1,30 @@
 #pragma once
 
+#include <exception>
+
 #include "util.hpp"
+#include "metrics.hpp"
 
 namespace glua {
+namespace detail {
+
+/**
+ * Run a wrapper body, converting any std::exception escaping from it
+ * into a lua error so it never unwinds through the lua interpreter.
+ * The message is pushed inside the handler but the error is raised
+ * after it, once the exception object has been destroyed.
+ */
+template<int(*Invoke)(lua_State*)>
+inline int _protect(lua_State* l) {
+    try {
+        return Invoke(l);
+    } catch(const std::exception& e) {
+        lua_pushstring(l, e.what());
+    }
+    return lua_error(l);
+}
+
+} // namespace detail
 
 template<typename FunctionT, FunctionT func>
 class cfunction {};
@@ -15,9 +37,19 @@ public:
     using argument_types = typename function_traits<func_type>::argument_types;
 
     static inline int wrapper(lua_State* l) {
-        return_type val = call_with_tuple(func, api::checkGet<argument_types>(*l));
+        return detail::_protect<&invoke>(l);
+    }
+
+private:
+    static inline int invoke(lua_State* l) {
+        detail::_call_timer timer(l, 1);
+        auto args = api::checkArgs<argument_types>(*l);
+        timer.argsDone();
+        return_type val = call_with_tuple(func, std::move(args));
+        timer.bodyDone();
         api::clearStack(*l);
-        api::push<Ret>(*l, val);
+        api::push<Ret>(*l, std::move(val));
+        timer.done();
         return function_traits<func_type>::nrets;
     }
 };
@@ -30,9 +62,19 @@ public:
     using argument_types = typename function_traits<func_type>::argument_types;
 
     static inline int wrapper(lua_State* l) {
-        return_type val = call_with_tuple(func, api::checkGet<argument_types>(*l));
+        return detail::_protect<&invoke>(l);
+    }
+
+private:
+    static inline int invoke(lua_State* l) {
+        detail::_call_timer timer(l, 1);
+        auto args = api::checkArgs<argument_types>(*l);
+        timer.argsDone();
+        return_type val = call_with_tuple(func, std::move(args));
+        timer.bodyDone();
         api::clearStack(*l);
-        api::push<Ret>(*l, val);
+        api::push<Ret>(*l, std::move(val));
+        timer.done();
         return function_traits<func_type>::nrets;
     }
 };
@@ -47,17 +89,27 @@ public:
     using return_type    = typename function_traits<func_type>::return_type;
     using argument_types = typename function_traits<func_type>::argument_types;
 
-    static inline void push(lua_State& l, Functor f) {
+    static inline void push(lua_State& l, Functor f, const char* name = "functor") {
         func_type& func = api::newUserdata<func_type>(l, "functor");
         new (&func) func_type(f);
-        lua_pushcclosure(&l, &wrapper, 1);
+        lua_pushcclosure(&l, &wrapper, 1 + detail::_push_binding_stats(l, name));
     }
 
     static inline int wrapper(lua_State* l) {
+        return detail::_protect<&invoke>(l);
+    }
+
+private:
+    static inline int invoke(lua_State* l) {
+        detail::_call_timer timer(l, 2);
         func_type& func = api::getUserdata<func_type>(*l, api::upvalueIndex(1), "functor");
-        return_type val = call_with_tuple(func, api::checkGet<argument_types>(*l));
+        auto args = api::checkArgs<argument_types>(*l);
+        timer.argsDone();
+        return_type val = call_with_tuple(func, std::move(args));
+        timer.bodyDone();
         api::clearStack(*l);
-        api::push<return_type>(*l, val);
+        api::push<return_type>(*l, std::move(val));
+        timer.done();
         return function_traits<func_type>::nrets;
     }
 };
@@ -69,16 +121,26 @@ public:
     using return_type    = typename function_traits<func_type>::return_type;
     using argument_types = typename function_traits<func_type>::argument_types;
 
-    static inline void push(lua_State& l, Functor f) {
+    static inline void push(lua_State& l, Functor f, const char* name = "functor") {
         func_type& func = api::newUserdata<func_type>(l, "functor");
         new (&func) func_type(f);
-        lua_pushcclosure(&l, &wrapper, 1);
+        lua_pushcclosure(&l, &wrapper, 1 + detail::_push_binding_stats(l, name));
     }
 
     static inline int wrapper(lua_State* l) {
+        return detail::_protect<&invoke>(l);
+    }
+
+private:
+    static inline int invoke(lua_State* l) {
+        detail::_call_timer timer(l, 2);
         func_type& func = api::getUserdata<func_type>(*l, api::upvalueIndex(1), "functor");
-        call_with_tuple(func, api::checkGet<argument_types>(*l));
+        auto args = api::checkArgs<argument_types>(*l);
+        timer.argsDone();
+        call_with_tuple(func, std::move(args));
+        timer.bodyDone();
         api::clearStack(*l);
+        timer.done();
         return function_traits<func_type>::nrets;
     }
 };
@@ -0,0 +1,552 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "api.hpp"
+
+/**
+ * channel.hpp
+ * Contains glua::basic_channel, a bounded multi-producer multi-consumer
+ * queue built on a lock-free ring buffer, and glua::channel, the
+ * specialization which carries serialized lua values between states.
+ *
+ * A channel is shared through a std::shared_ptr; pushing that pointer
+ * into a state (for example with state["jobs"] = ch) exposes it to
+ * scripts as a userdata with the methods send, trySend, recv, tryRecv,
+ * recvAsync and close. recv blocks the calling thread, while recvAsync
+ * yields the running coroutine until a message is available.
+ */
+
+namespace glua {
+namespace detail {
+
+/**
+ * Bounded MPMC ring buffer. Every cell carries a sequence number
+ * which tells producers and consumers whether the cell is free for
+ * the current lap, so a push or pop is a single compare and swap on
+ * the shared position plus a release store on the cell.
+ *
+ * The capacity is rounded up to a power of two.
+ */
+template<typename T>
+class _mpmc_ring {
+public:
+    explicit _mpmc_ring(size_t capacity) : mask(round_up(capacity) - 1), cells(new cell[mask + 1]) {
+        for(size_t i = 0; i <= mask; ++i) cells[i].seq.store(i, std::memory_order_relaxed);
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+    }
+
+    _mpmc_ring(const _mpmc_ring&) = delete;
+    _mpmc_ring& operator=(const _mpmc_ring&) = delete;
+
+    bool tryPush(T&& val) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for(;;) {
+            cell& c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if(diff == 0) {
+                if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = std::move(val);
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T& out) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for(;;) {
+            cell& c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if(diff == 0) {
+                if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(c.value);
+                    c.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Approximate number of queued elements; exact only when no
+     * other thread is touching the ring.
+     */
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    static size_t round_up(size_t n) {
+        size_t r = 2;
+        while(r < n) r <<= 1;
+        return r;
+    }
+
+    const size_t mask;
+    std::unique_ptr<cell[]> cells;
+    // Keep producers and consumers on separate cache lines
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+/**
+ * Back off while waiting on a full or empty ring: spin briefly,
+ * then give up the time slice, then sleep.
+ */
+inline void _channel_backoff(unsigned& spins) {
+    if(spins < 64)        ++spins;
+    else if(spins < 128) { ++spins; std::this_thread::yield(); }
+    else                  std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+/**
+ * Tags used by the channel wire format.
+ */
+enum _pack_tag : char {
+    _pack_nil     = 'n',
+    _pack_false   = 'f',
+    _pack_true    = 't',
+    _pack_number  = 'd',
+    _pack_integer = 'i',
+    _pack_string  = 's',
+    _pack_table   = '{',
+    _pack_end     = '}'
+};
+
+constexpr int _pack_max_depth = 32;
+
+template<typename T>
+inline void _pack_raw(std::string& out, T val) {
+    out.append(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template<typename T>
+inline bool _unpack_raw(const char*& p, const char* end, T& val) {
+    if(static_cast<size_t>(end - p) < sizeof(T)) return false;
+    std::memcpy(&val, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+/**
+ * Serialize the value at index into out. Tables are copied
+ * recursively (without cycles). Returns nullptr on success,
+ * or a static error message; this function never raises a lua
+ * error so the caller can release its buffers first.
+ */
+inline const char* _pack_value(lua_State& l, int index, std::string& out, int depth = 0) {
+    switch(lua_type(&l, index)) {
+    case LUA_TNIL:
+        out.push_back(_pack_nil);
+        return nullptr;
+    case LUA_TBOOLEAN:
+        out.push_back(lua_toboolean(&l, index) ? _pack_true : _pack_false);
+        return nullptr;
+    case LUA_TNUMBER:
+        if(_is_integer(&l, index)) {
+            out.push_back(_pack_integer);
+            _pack_raw(out, lua_tointeger(&l, index));
+        } else {
+            out.push_back(_pack_number);
+            _pack_raw(out, lua_tonumber(&l, index));
+        }
+        return nullptr;
+    case LUA_TSTRING: {
+        size_t len = 0;
+        const char* str = lua_tolstring(&l, index, &len);
+        out.push_back(_pack_string);
+        _pack_raw(out, len);
+        out.append(str, len);
+        return nullptr;
+    }
+    case LUA_TTABLE: {
+        if(depth >= _pack_max_depth) return "channel: table nesting too deep (cyclic table?)";
+        if(!lua_checkstack(&l, 3)) return "channel: stack overflow";
+        index = lua_absindex(&l, index);
+        out.push_back(_pack_table);
+        lua_pushnil(&l);
+        while(lua_next(&l, index)) {
+            const char* err = _pack_value(l, -2, out, depth + 1);
+            if(err == nullptr) err = _pack_value(l, -1, out, depth + 1);
+            if(err != nullptr) {
+                lua_pop(&l, 2);
+                return err;
+            }
+            lua_pop(&l, 1);
+        }
+        out.push_back(_pack_end);
+        return nullptr;
+    }
+    default:
+        return "channel: only nil, booleans, numbers, strings and tables can be sent";
+    }
+}
+
+/**
+ * Push the next serialized value in [p, end) onto the stack.
+ * Returns false if the data is malformed.
+ */
+inline bool _unpack_value(lua_State& l, const char*& p, const char* end) {
+    if(p == end || !lua_checkstack(&l, 3)) return false;
+    switch(*p++) {
+    case _pack_nil:   lua_pushnil(&l);          return true;
+    case _pack_false: lua_pushboolean(&l, 0);   return true;
+    case _pack_true:  lua_pushboolean(&l, 1);   return true;
+    case _pack_number: {
+        lua_Number n;
+        if(!_unpack_raw(p, end, n)) return false;
+        lua_pushnumber(&l, n);
+        return true;
+    }
+    case _pack_integer: {
+        lua_Integer i;
+        if(!_unpack_raw(p, end, i)) return false;
+        lua_pushinteger(&l, i);
+        return true;
+    }
+    case _pack_string: {
+        size_t len;
+        if(!_unpack_raw(p, end, len) || static_cast<size_t>(end - p) < len) return false;
+        lua_pushlstring(&l, p, len);
+        p += len;
+        return true;
+    }
+    case _pack_table:
+        lua_newtable(&l);
+        while(p != end && *p != _pack_end) {
+            if(!_unpack_value(l, p, end)) return false;
+            if(!_unpack_value(l, p, end)) return false;
+            lua_rawset(&l, -3);
+        }
+        if(p == end) return false;
+        ++p;
+        return true;
+    default:
+        return false;
+    }
+}
+
+} // namespace detail
+
+/**
+ * A bounded, lock-free MPMC channel carrying values of type T.
+ * Usable directly from c++ to hand moved payloads between threads.
+ */
+template<typename T>
+class basic_channel {
+public:
+    explicit basic_channel(size_t capacity) : ring(capacity), closed(false) {}
+
+    /**
+     * Try to enqueue a value without blocking. Returns false
+     * if the channel is full or closed.
+     */
+    bool trySend(T&& val) {
+        if(isClosed()) return false;
+        return ring.tryPush(std::move(val));
+    }
+
+    /**
+     * Enqueue a value, waiting for space if the channel is full.
+     * Returns false if the channel was closed.
+     */
+    bool send(T&& val) {
+        unsigned spins = 0;
+        while(!isClosed()) {
+            if(ring.tryPush(std::move(val))) return true;
+            detail::_channel_backoff(spins);
+        }
+        return false;
+    }
+
+    /**
+     * Try to dequeue a value without blocking.
+     */
+    bool tryRecv(T& out) {
+        return ring.tryPop(out);
+    }
+
+    /**
+     * Dequeue a value, waiting until one is available. Returns
+     * false once the channel is closed and drained.
+     */
+    bool recv(T& out) {
+        unsigned spins = 0;
+        for(;;) {
+            if(ring.tryPop(out)) return true;
+            if(isClosed()) return ring.tryPop(out);
+            detail::_channel_backoff(spins);
+        }
+    }
+
+    /**
+     * Close the channel. Pending values can still be received,
+     * but no new values are accepted and blocked receivers return.
+     */
+    void close() { closed.store(true, std::memory_order_release); }
+
+    bool isClosed() const { return closed.load(std::memory_order_acquire); }
+
+    size_t size() const { return ring.size(); }
+    size_t capacity() const { return ring.capacity(); }
+
+private:
+    detail::_mpmc_ring<T> ring;
+    std::atomic<bool> closed;
+};
+
+/**
+ * Channel of serialized lua values, shareable between states.
+ * Each message holds every argument passed to a single send.
+ */
+class channel : public basic_channel<std::string> {
+public:
+    static constexpr const char* metatable = "glua.channel";
+
+    explicit channel(size_t capacity) : basic_channel<std::string>(capacity) {}
+
+    /**
+     * Push a lua userdata referring to ch onto the stack.
+     */
+    static inline void push(lua_State& l, std::shared_ptr<channel> ch) {
+        using holder = std::shared_ptr<channel>;
+        holder* h = static_cast<holder*>(lua_newuserdata(&l, sizeof(holder)));
+        if(h == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+        new (h) holder(std::move(ch));
+        if(luaL_newmetatable(&l, metatable)) {
+            static const luaL_Reg methods[] = {
+                {"send",      &l_send},
+                {"trySend",   &l_try_send},
+                {"recv",      &l_recv},
+                {"tryRecv",   &l_try_recv},
+#ifndef GLUA_LUAJIT
+                {"recvAsync", &l_recv_async},
+#endif
+                {"close",     &l_close},
+                {nullptr,     nullptr}
+            };
+            lua_newtable(&l);
+            luaL_setfuncs(&l, methods, 0);
+#ifdef GLUA_LUAJIT
+            pushRecvAsync(l);
+            lua_setfield(&l, -2, "recvAsync");
+#endif
+            lua_setfield(&l, -2, "__index");
+            lua_pushcfunction(&l, &l_len);
+            lua_setfield(&l, -2, "__len");
+            lua_pushcfunction(&l, &l_gc);
+            lua_setfield(&l, -2, "__gc");
+        }
+        lua_setmetatable(&l, -2);
+    }
+
+    /**
+     * Get the channel referred to by the userdata at index.
+     */
+    static inline std::shared_ptr<channel> get(lua_State& l, int index) {
+        return *static_cast<std::shared_ptr<channel>*>(luaL_checkudata(&l, index, metatable));
+    }
+
+private:
+    static inline channel& self(lua_State* l) {
+        return **static_cast<std::shared_ptr<channel>*>(luaL_checkudata(l, 1, metatable));
+    }
+
+    /**
+     * Serialize arguments 2..top into a message and hand it to
+     * send (blocking or not). Pushes true on success, false if the
+     * channel was full or closed.
+     */
+    template<bool Blocking>
+    static inline int send_impl(lua_State* l) {
+        channel& ch = self(l);
+        const char* err = nullptr;
+        bool sent = false;
+        {
+            std::string msg;
+            int top = lua_gettop(l);
+            for(int i = 2; i <= top && err == nullptr; ++i) {
+                err = detail::_pack_value(*l, i, msg);
+            }
+            if(err == nullptr) sent = Blocking ? ch.send(std::move(msg)) : ch.trySend(std::move(msg));
+        }
+        if(err != nullptr) return luaL_error(l, "%s", err);
+        lua_pushboolean(l, sent);
+        return 1;
+    }
+
+    /**
+     * Unpack the message pointed to by argument 1 onto the stack,
+     * returning the number of values.
+     */
+    static int l_unpack(lua_State* l) {
+        const std::string& msg = *static_cast<const std::string*>(lua_touserdata(l, 1));
+        const char* p = msg.data();
+        const char* end = p + msg.size();
+        while(p != end) {
+            if(!detail::_unpack_value(*l, p, end)) return luaL_error(l, "channel: malformed message");
+        }
+        return lua_gettop(l) - 1;
+    }
+
+    /**
+     * Take a message from ch, waiting for one if Blocking, and push
+     * its values. Returns their number, or -1 if there was no message.
+     * The values are pushed in a protected call and the message freed
+     * before any error is raised again, so no buffer outlives a lua
+     * error.
+     */
+    template<bool Blocking>
+    static inline int receive(lua_State* l, channel& ch) {
+        int n;
+        int status;
+        {
+            std::string msg;
+            if(!(Blocking ? ch.recv(msg) : ch.tryRecv(msg))) return -1;
+            int top = lua_gettop(l);
+            lua_pushcfunction(l, &l_unpack);
+            lua_pushlightuserdata(l, &msg);
+            status = lua_pcall(l, 1, LUA_MULTRET, 0);
+            n = lua_gettop(l) - top;
+        }
+        if(status != LUA_OK) return lua_error(l);
+        return n;
+    }
+
+    static int l_send(lua_State* l)     { return send_impl<true>(l); }
+    static int l_try_send(lua_State* l) { return send_impl<false>(l); }
+
+    static int l_recv(lua_State* l) {
+        int n = receive<true>(l, self(l));
+        return n < 0 ? 0 : n;
+    }
+
+    static int l_try_recv(lua_State* l) {
+        int n = receive<false>(l, self(l));
+        return n < 0 ? 0 : n;
+    }
+
+#ifndef GLUA_LUAJIT
+    /**
+     * Receive without blocking the thread: while the channel is
+     * empty, yield the running coroutine and retry when resumed.
+     */
+    static int l_recv_async(lua_State* l) {
+        channel& ch = self(l);
+        int n = receive<false>(l, ch);
+        if(n >= 0) return n;
+        if(ch.isClosed()) return 0;
+        lua_settop(l, 1);
+        return detail::_yield_restart<&l_recv_async>(l, 0);
+    }
+#else
+    /**
+     * Like tryRecv, but returns true followed by the message, false
+     * if the channel is empty and nothing if it is closed.
+     */
+    static int l_poll(lua_State* l) {
+        channel& ch = self(l);
+        lua_pushboolean(l, 1);
+        int n = receive<false>(l, ch);
+        if(n >= 0) return 1 + n;
+        lua_pop(l, 1);
+        if(ch.isClosed()) return 0;
+        lua_pushboolean(l, 0);
+        return 1;
+    }
+
+    /**
+     * LuaJIT can't resume a yielding C function, so recvAsync is a
+     * lua function which polls and yields between attempts.
+     */
+    static inline void pushRecvAsync(lua_State& l) {
+        static const char* source =
+            "local poll, yield = ...\n"
+            "local retry\n"
+            "local function handle(self, got, ...)\n"
+            "    if got == false then yield() return retry(self) end\n"
+            "    return ...\n"
+            "end\n"
+            "retry = function(self) return handle(self, poll(self)) end\n"
+            "return retry\n";
+        if(luaL_loadstring(&l, source) != LUA_OK) lua_error(&l);
+        lua_pushcfunction(&l, &l_poll);
+        lua_getglobal(&l, "coroutine");
+        lua_getfield(&l, -1, "yield");
+        lua_remove(&l, -2);
+        lua_call(&l, 2, 1);
+    }
+#endif
+
+    static int l_close(lua_State* l) {
+        self(l).close();
+        return 0;
+    }
+
+    static int l_len(lua_State* l) {
+        lua_pushinteger(l, static_cast<lua_Integer>(self(l).size()));
+        return 1;
+    }
+
+    static int l_gc(lua_State* l) {
+        using holder = std::shared_ptr<channel>;
+        static_cast<holder*>(lua_touserdata(l, 1))->~holder();
+        return 0;
+    }
+};
+
+namespace api {
+namespace detail {
+
+/**
+ * Push implementation for shared channels.
+ */
+template<>
+struct _push_impl<std::shared_ptr<channel>> {
+    inline static void push(lua_State& l, std::shared_ptr<channel> ch) {
+        channel::push(l, std::move(ch));
+    }
+};
+
+/**
+ * Get implementation for shared channels.
+ */
+template<>
+struct _check_get_impl<std::shared_ptr<channel>> {
+    inline static std::shared_ptr<channel> get(lua_State& l, int index) {
+        return channel::get(l, index);
+    }
+};
+
+} // namespace detail
+} // namespace api
+
+} // namespace glua
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <type_traits>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/**
+ * compat.hpp
+ * Differences between the lua versions glua builds against (5.2,
+ * 5.3 and 5.4, and LuaJIT 2.1 through its 5.1 api), selected on
+ * LUA_VERSION_NUM. The rest of glua calls the helpers here instead
+ * of version specific api functions.
+ *
+ * From 5.3 on lua has a native 64-bit integer subtype, and integral
+ * C++ types are passed as lua_Integer without going through
+ * lua_Number. On 5.2 integral types which fit lua_Integer are passed
+ * as integers and wider unsigned types as numbers, as
+ * lua_pushunsigned did.
+ *
+ * The 5.1 api is only supported as provided by LuaJIT 2.1, which
+ * adds lua_tonumberx, lua_tointegerx, luaL_testudata, luaL_traceback
+ * and luaL_setfuncs from 5.2. The rest of the 5.2 api glua uses is
+ * emulated below. Under LuaJIT C functions can't yield with a
+ * continuation and hooks can't yield at all, and one hook is shared
+ * by all coroutines.
+ */
+
+#if LUA_VERSION_NUM < 501
+#error "glua requires lua 5.2 or later, or LuaJIT 2.1"
+#endif
+
+#if LUA_VERSION_NUM == 501
+#define GLUA_LUAJIT 1
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define GLUA_NATIVE_INTEGERS 1
+#endif
+
+#ifdef GLUA_LUAJIT
+
+/*
+ * Parts of the 5.2 api which LuaJIT lacks.
+ */
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#ifndef LUA_GCISRUNNING
+#define LUA_GCISRUNNING 9
+#endif
+
+typedef size_t lua_Unsigned;
+
+inline int lua_absindex(lua_State* l, int index) {
+    return (index > 0 || index <= LUA_REGISTRYINDEX) ? index : lua_gettop(l) + index + 1;
+}
+
+inline size_t lua_rawlen(lua_State* l, int index) {
+    return lua_objlen(l, index);
+}
+
+inline void lua_rawgetp(lua_State* l, int index, const void* p) {
+    index = lua_absindex(l, index);
+    lua_pushlightuserdata(l, const_cast<void*>(p));
+    lua_rawget(l, index);
+}
+
+inline void lua_rawsetp(lua_State* l, int index, const void* p) {
+    index = lua_absindex(l, index);
+    lua_pushlightuserdata(l, const_cast<void*>(p));
+    lua_insert(l, -2);
+    lua_rawset(l, index);
+}
+
+#endif
+
+namespace glua {
+namespace detail {
+
+/**
+ * True for the C++ types marshalled as lua integers: all integral
+ * types except bool.
+ */
+template<typename T>
+struct _is_lua_integral : std::integral_constant<bool,
+    std::is_integral<T>::value && !std::is_same<T, bool>::value> {};
+
+/**
+ * True if every value of the integral type T can be passed as a
+ * lua_Integer. With native integers this holds for all of them,
+ * wide unsigned values wrapping around like lua_Unsigned does.
+ */
+template<typename T>
+struct _fits_lua_integer : std::integral_constant<bool,
+#ifdef GLUA_NATIVE_INTEGERS
+    true
+#else
+    std::is_signed<T>::value ? sizeof(T) <= sizeof(lua_Integer) : sizeof(T) < sizeof(lua_Integer)
+#endif
+> {};
+
+template<typename T>
+inline typename std::enable_if<_fits_lua_integer<T>::value>::type
+_push_integral(lua_State* l, T val) {
+    lua_pushinteger(l, static_cast<lua_Integer>(val));
+}
+
+template<typename T>
+inline typename std::enable_if<!_fits_lua_integer<T>::value>::type
+_push_integral(lua_State* l, T val) {
+    lua_pushnumber(l, static_cast<lua_Number>(val));
+}
+
+/**
+ * Convert the value at index to the integral type T; isnum is set
+ * to 0 if it is not a number (or, with native integers, a number
+ * without an exact integer representation).
+ */
+template<typename T>
+inline typename std::enable_if<_fits_lua_integer<T>::value, T>::type
+_to_integral(lua_State* l, int index, int* isnum) {
+    return static_cast<T>(lua_tointegerx(l, index, isnum));
+}
+
+template<typename T>
+inline typename std::enable_if<!_fits_lua_integer<T>::value, T>::type
+_to_integral(lua_State* l, int index, int* isnum) {
+    return static_cast<T>(lua_tonumberx(l, index, isnum));
+}
+
+/**
+ * True if the value at index is a number with the integer subtype.
+ * Always false without native integers.
+ */
+inline bool _is_integer(lua_State* l, int index) {
+#ifdef GLUA_NATIVE_INTEGERS
+    return lua_isinteger(l, index) != 0;
+#else
+    (void)l;
+    (void)index;
+    return false;
+#endif
+}
+
+/**
+ * lua_resume. The number of values yielded or returned is stored in
+ * nresults; before 5.4 these are the whole stack of the coroutine.
+ */
+inline int _resume(lua_State* co, lua_State* from, int nargs, int* nresults) {
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(co, from, nargs, nresults);
+#elif defined(GLUA_LUAJIT)
+    (void)from;
+    int status = lua_resume(co, nargs);
+    *nresults = lua_gettop(co);
+    return status;
+#else
+    int status = lua_resume(co, from, nargs);
+    *nresults = lua_gettop(co);
+    return status;
+#endif
+}
+
+#ifdef GLUA_LUAJIT
+inline const void* _main_thread_key() {
+    static const char key = 0;
+    return &key;
+}
+#endif
+
+/**
+ * The main thread of the state l belongs to, or nullptr if unknown.
+ * The 5.1 registry has no entry for it, so there it is only known for
+ * states registered with _set_main_thread.
+ */
+inline lua_State* _main_thread(lua_State* l) {
+#ifdef GLUA_LUAJIT
+    lua_rawgetp(l, LUA_REGISTRYINDEX, _main_thread_key());
+#else
+    lua_rawgeti(l, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+#endif
+    lua_State* main = lua_tothread(l, -1);
+    lua_pop(l, 1);
+    return main;
+}
+
+/**
+ * Record l as the main thread of its state (5.1 only).
+ */
+inline void _set_main_thread(lua_State* l) {
+#ifdef GLUA_LUAJIT
+    lua_pushthread(l);
+    lua_rawsetp(l, LUA_REGISTRYINDEX, _main_thread_key());
+#else
+    (void)l;
+#endif
+}
+
+/**
+ * Push the table of globals.
+ */
+inline void _push_globals(lua_State* l) {
+#ifdef GLUA_LUAJIT
+    lua_pushvalue(l, LUA_GLOBALSINDEX);
+#else
+    lua_pushglobaltable(l);
+#endif
+}
+
+/**
+ * Open a standard library, set the global name to it and leave it
+ * on the stack.
+ */
+inline void _open_lib(lua_State* l, const char* name, lua_CFunction open) {
+#ifdef GLUA_LUAJIT
+    lua_pushcfunction(l, open);
+    lua_pushstring(l, name);
+    lua_call(l, 1, 1);
+#else
+    luaL_requiref(l, name, open, 1);
+#endif
+}
+
+/**
+ * Pop a table and make it the environment of the loaded chunk at
+ * index (its _ENV upvalue, or its fenv on 5.1).
+ */
+inline void _set_chunk_env(lua_State* l, int index) {
+#ifdef GLUA_LUAJIT
+    lua_setfenv(l, index);
+#else
+    if(lua_setupvalue(l, index, 1) == nullptr) lua_pop(l, 1);
+#endif
+}
+
+/**
+ * Dump the function on top of the stack as bytecode, without debug
+ * information if strip is set and the version supports it.
+ */
+inline int _dump(lua_State* l, lua_Writer writer, void* data, bool strip) {
+#if LUA_VERSION_NUM >= 503
+    return lua_dump(l, writer, data, strip ? 1 : 0);
+#else
+    (void)strip;
+    return lua_dump(l, writer, data);
+#endif
+}
+
+/**
+ * Name of the field of package holding the module searchers.
+ */
+#ifdef GLUA_LUAJIT
+constexpr const char* _searchers_field = "loaders";
+#else
+constexpr const char* _searchers_field = "searchers";
+#endif
+
+#ifndef GLUA_LUAJIT
+/**
+ * Continuation which calls F again, for C functions which yield and
+ * simply restart once resumed.
+ */
+#if LUA_VERSION_NUM >= 503
+template<lua_CFunction F>
+inline int _restart(lua_State* l, int, lua_KContext) {
+    return F(l);
+}
+#else
+template<lua_CFunction F>
+inline int _restart(lua_State* l) {
+    return F(l);
+}
+#endif
+
+/**
+ * Yield nresults values from a C function, calling F when resumed.
+ */
+template<lua_CFunction F>
+inline int _yield_restart(lua_State* l, int nresults) {
+    return lua_yieldk(l, nresults, 0, &_restart<F>);
+}
+#endif
+
+} // namespace detail
+} // namespace glua
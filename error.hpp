@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+/**
+ * error.hpp
+ * Exception types thrown when a protected lua call fails, and the
+ * message handler which attaches a traceback to lua errors.
+ *
+ * The handler only runs once an error has been raised. glua::state
+ * installs it once, in the bottom slot of its main thread, so a call
+ * there which succeeds costs the same as a plain lua_pcall. On other
+ * threads, or if that slot has been cleared, the handler is inserted
+ * below the function for each call and removed afterwards.
+ */
+
+namespace glua {
+
+/**
+ * Base class of all errors reported by lua. what() is the error
+ * message, traceback() the stack traceback at the point of the error
+ * (empty if none was available).
+ */
+class error : public std::runtime_error {
+public:
+    error(const std::string& msg, const std::string& traceback, int status)
+    : std::runtime_error(msg), trace(traceback), code(status) {}
+
+    inline const std::string& traceback() const { return trace; }
+
+    /**
+     * The lua status code (LUA_ERRRUN, LUA_ERRSYNTAX, ...).
+     */
+    inline int status() const { return code; }
+
+private:
+    std::string trace;
+    int code;
+};
+
+/**
+ * A runtime error raised by a script.
+ */
+class script_error : public error {
+public:
+    script_error(const std::string& msg, const std::string& traceback)
+    : error(msg, traceback, LUA_ERRRUN) {}
+};
+
+/**
+ * A chunk failed to compile.
+ */
+class syntax_error : public error {
+public:
+    explicit syntax_error(const std::string& msg) : error(msg, "", LUA_ERRSYNTAX) {}
+};
+
+/**
+ * Lua ran out of memory (or hit the state's memory limit).
+ */
+class memory_error : public error {
+public:
+    explicit memory_error(const std::string& msg) : error(msg, "", LUA_ERRMEM) {}
+};
+
+/**
+ * A file could not be opened or read.
+ */
+class file_error : public error {
+public:
+    explicit file_error(const std::string& msg) : error(msg, "", LUA_ERRFILE) {}
+};
+
+/**
+ * An error was raised while running a message handler or __gc metamethod.
+ */
+class handler_error : public error {
+public:
+    handler_error(const std::string& msg, int status) : error(msg, "", status) {}
+};
+
+namespace detail {
+
+constexpr const char* _traceback_marker = "\nstack traceback:";
+
+/**
+ * Message handler for protected calls: appends a traceback to
+ * string errors and leaves any other error object untouched.
+ */
+inline int _message_handler(lua_State* l) {
+    const char* msg = lua_tostring(l, 1);
+    if(msg == nullptr) return 1;
+    luaL_traceback(l, l, msg, 1);
+    return 1;
+}
+
+/**
+ * Stack slot where glua::state keeps the message handler on its main
+ * thread, so protected calls there can name it instead of pushing
+ * it under the arguments.
+ */
+constexpr int _handler_slot = 1;
+
+/**
+ * Put the message handler in its slot; the stack must be empty.
+ */
+inline void _install_handler(lua_State& l) {
+    lua_pushcfunction(&l, &_message_handler);
+}
+
+/**
+ * lua_pcall with the message handler. Uses the installed one if the
+ * stack still has it, and otherwise inserts one below the function
+ * for the duration of the call.
+ */
+inline int _pcall(lua_State& l, int nargs, int nret) {
+    if(lua_tocfunction(&l, _handler_slot) == &_message_handler && lua_gettop(&l) - nargs > _handler_slot) {
+        return lua_pcall(&l, nargs, nret, _handler_slot);
+    }
+    int base = lua_gettop(&l) - nargs;
+    lua_pushcfunction(&l, &_message_handler);
+    lua_insert(&l, base);
+    int status = lua_pcall(&l, nargs, nret, base);
+    lua_remove(&l, base);
+    return status;
+}
+
+/**
+ * Pop the error object of a failed call or load with the given
+ * status and throw the matching exception.
+ */
+[[noreturn]] inline void _throw_error(lua_State& l, int status) {
+    std::string msg;
+    if(lua_type(&l, -1) == LUA_TSTRING) {
+        msg = lua_tostring(&l, -1);
+    } else {
+        msg = std::string("(error object is a ") + luaL_typename(&l, -1) + " value)";
+    }
+    lua_pop(&l, 1);
+
+    switch(status) {
+    case LUA_ERRRUN: {
+        std::string::size_type pos = msg.find(_traceback_marker);
+        if(pos == std::string::npos) throw script_error(msg, "");
+        throw script_error(msg.substr(0, pos), msg.substr(pos + 1));
+    }
+    case LUA_ERRSYNTAX: throw syntax_error(msg);
+    case LUA_ERRMEM:    throw memory_error(msg);
+    case LUA_ERRFILE:   throw file_error(msg);
+    default:            throw handler_error(msg, status);
+    }
+}
+
+} // namespace detail
+} // namespace glua
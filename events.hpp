@@ -0,0 +1,258 @@
+#pragma once
+
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "api.hpp"
+#include "selector.hpp"
+
+/**
+ * events.hpp
+ * Contains glua::event_bus, which calls all the lua handlers of an
+ * event with one call into lua. Handlers are kept per event name in
+ * arrays in a lua table; emitting an event pushes the payload once
+ * and enters a single C function which calls every handler with
+ * copies of the payload slots, so the registry fetch, argument
+ * conversion and protected call are paid once per event rather than
+ * once per handler.
+ *
+ * Scripts reach the bus through a table set up by expose:
+ *
+ *   events.on("tick", function(dt) ... end)
+ *   events.off("tick", f)
+ *   events.emit("tick", 0.016)
+ *
+ * Handlers run in the order they subscribed. Handlers added during
+ * a dispatch are first called by the next one, and those removed
+ * during a dispatch are still called by it. An error in a handler
+ * stops the dispatch and is thrown as a glua::error.
+ */
+
+namespace glua {
+
+class event_bus {
+public:
+    /**
+     * Create an empty bus in l.
+     */
+    explicit event_bus(lua_State& l) : l(l) {
+        lua_newtable(&l);
+        key = luaL_ref(&l, LUA_REGISTRYINDEX);
+    }
+
+    event_bus(const event_bus&) = delete;
+    event_bus& operator=(const event_bus&) = delete;
+
+    ~event_bus() {
+        luaL_unref(&l, LUA_REGISTRYINDEX, key);
+    }
+
+    /**
+     * Set the global name to a table with the functions on, off and
+     * emit for scripts.
+     */
+    inline void expose(const char* name) {
+        static const luaL_Reg functions[] = {
+            {"on",   &l_on},
+            {"off",  &l_off},
+            {"emit", &l_emit},
+            {nullptr, nullptr}
+        };
+        lua_createtable(&l, 0, 3);
+        lua_rawgeti(&l, LUA_REGISTRYINDEX, key);
+        luaL_setfuncs(&l, functions, 1);
+        lua_setglobal(&l, name);
+    }
+
+    /**
+     * Add the function sel refers to as a handler of event.
+     */
+    template<typename S, typename std::enable_if<
+        std::is_base_of<selector_base, typename std::decay<S>::type>::value>::type* = nullptr>
+    inline void subscribe(const char* event, S&& sel) {
+        int base = lua_gettop(&l);
+        sel.push();
+        if(lua_type(&l, -1) != LUA_TFUNCTION) {
+            lua_settop(&l, base);
+            throw std::runtime_error("Error: event handlers must be functions");
+        }
+        lua_rawgeti(&l, LUA_REGISTRYINDEX, key);
+        lua_pushstring(&l, event);
+        add(&l, lua_gettop(&l) - 1, lua_gettop(&l), lua_gettop(&l) - 2);
+        lua_settop(&l, base);
+    }
+
+    /**
+     * Remove all handlers of event.
+     */
+    inline void clear(const char* event) {
+        lua_rawgeti(&l, LUA_REGISTRYINDEX, key);
+        lua_pushnil(&l);
+        lua_setfield(&l, -2, event);
+        lua_pop(&l, 1);
+    }
+
+    /**
+     * The number of handlers of event.
+     */
+    inline size_t handlers(const char* event) {
+        lua_rawgeti(&l, LUA_REGISTRYINDEX, key);
+        lua_getfield(&l, -1, event);
+        size_t n = lua_type(&l, -1) == LUA_TTABLE ? lua_rawlen(&l, -1) : 0;
+        lua_pop(&l, 2);
+        return n;
+    }
+
+    /**
+     * Call every handler of event with args. Returns the number of
+     * handlers called.
+     */
+    template<typename... Args>
+    inline size_t emit(const char* event, Args&&... args) {
+        int base = lua_gettop(&l);
+        if(!prepare(event, false)) return 0;
+        api::push(l, std::forward<Args>(args)...);
+        api::call(l, 2 + sizeof...(Args), 1);
+        size_t n = static_cast<size_t>(lua_tointeger(&l, -1));
+        lua_settop(&l, base);
+        return n;
+    }
+
+    /**
+     * Call every handler of event with args and return the results
+     * which are not nil, converted to R, in handler order.
+     */
+    template<typename R, typename... Args>
+    inline std::vector<R> collect(const char* event, Args&&... args) {
+        std::vector<R> results;
+        int base = lua_gettop(&l);
+        if(!prepare(event, true)) return results;
+        api::push(l, std::forward<Args>(args)...);
+        api::call(l, 2 + sizeof...(Args), LUA_MULTRET);
+        int top = lua_gettop(&l);
+        try {
+            results.reserve(static_cast<size_t>(top - base));
+            for(int i = base + 1; i <= top; ++i) results.push_back(api::detail::_arg_impl<R>::get(l, i));
+        } catch(...) {
+            lua_settop(&l, base);
+            throw;
+        }
+        lua_settop(&l, base);
+        return results;
+    }
+
+private:
+    /**
+     * Push the dispatcher, the collect flag and the handlers of
+     * event, or push nothing and return false if there are none.
+     */
+    inline bool prepare(const char* event, bool collect) {
+        lua_pushcfunction(&l, &l_dispatch);
+        lua_pushboolean(&l, collect);
+        lua_rawgeti(&l, LUA_REGISTRYINDEX, key);
+        lua_getfield(&l, -1, event);
+        lua_remove(&l, -2);
+        if(lua_type(&l, -1) == LUA_TTABLE && lua_rawlen(&l, -1) != 0) return true;
+        lua_pop(&l, 3);
+        return false;
+    }
+
+    /**
+     * Append the function at fn to the handlers of the event named at
+     * event in the bus table at bus.
+     */
+    static inline void add(lua_State* l, int bus, int event, int fn) {
+        lua_pushvalue(l, event);
+        lua_rawget(l, bus);
+        if(lua_type(l, -1) != LUA_TTABLE) {
+            lua_pop(l, 1);
+            lua_newtable(l);
+            lua_pushvalue(l, event);
+            lua_pushvalue(l, -2);
+            lua_rawset(l, bus);
+        }
+        lua_pushvalue(l, fn);
+        lua_rawseti(l, -2, static_cast<int>(lua_rawlen(l, -2)) + 1);
+        lua_pop(l, 1);
+    }
+
+    /**
+     * The dispatcher: (collect, handlers, payload...). Calls each
+     * handler with the payload; returns the number of handlers
+     * called, or the results which are not nil if collecting.
+     */
+    static int l_dispatch(lua_State* l) {
+        bool collect = lua_toboolean(l, 1) != 0;
+        int top = lua_gettop(l);
+        int nargs = top - 2;
+        // Handlers removed meanwhile are replaced by a copy, see l_off
+        int n = static_cast<int>(lua_rawlen(l, 2));
+        int results = 0;
+        for(int i = 1; i <= n; ++i) {
+            luaL_checkstack(l, nargs + 2, "too many event results");
+            lua_rawgeti(l, 2, i);
+            for(int a = 3; a <= top; ++a) lua_pushvalue(l, a);
+            lua_call(l, nargs, collect ? 1 : 0);
+            if(collect) {
+                if(lua_isnil(l, -1)) lua_pop(l, 1);
+                else                 ++results;
+            }
+        }
+        if(collect) return results;
+        lua_pushinteger(l, n);
+        return 1;
+    }
+
+    static int l_on(lua_State* l) {
+        luaL_checkstring(l, 1);
+        luaL_checktype(l, 2, LUA_TFUNCTION);
+        add(l, lua_upvalueindex(1), 1, 2);
+        return 0;
+    }
+
+    /**
+     * Removes a handler by replacing the array with a copy, so a
+     * dispatch running over the old one is unaffected.
+     */
+    static int l_off(lua_State* l) {
+        luaL_checkstring(l, 1);
+        luaL_checktype(l, 2, LUA_TFUNCTION);
+        lua_settop(l, 2);
+        lua_pushvalue(l, 1);
+        lua_rawget(l, lua_upvalueindex(1));
+        if(lua_type(l, 3) != LUA_TTABLE) return 0;
+        int n = static_cast<int>(lua_rawlen(l, 3));
+        lua_createtable(l, n, 0);
+        int kept = 0;
+        for(int i = 1; i <= n; ++i) {
+            lua_rawgeti(l, 3, i);
+            if(lua_rawequal(l, -1, 2)) lua_pop(l, 1);
+            else                       lua_rawseti(l, 4, ++kept);
+        }
+        lua_pushvalue(l, 1);
+        if(kept == 0) lua_pushnil(l);
+        else          lua_pushvalue(l, 4);
+        lua_rawset(l, lua_upvalueindex(1));
+        return 0;
+    }
+
+    static int l_emit(lua_State* l) {
+        luaL_checkstring(l, 1);
+        lua_pushvalue(l, 1);
+        lua_rawget(l, lua_upvalueindex(1));
+        if(lua_type(l, -1) != LUA_TTABLE) {
+            lua_pushinteger(l, 0);
+            return 1;
+        }
+        lua_replace(l, 1);
+        lua_pushboolean(l, 0);
+        lua_insert(l, 1);
+        return l_dispatch(l);
+    }
+
+    lua_State& l;
+    int key;
+};
+
+} // namespace glua
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "api.hpp"
+
+/**
+ * ffi.hpp
+ * Exposes plain C++ structs to the LuaJIT FFI, so JIT-compiled
+ * traces read and write C++ memory directly instead of calling
+ * through userdata metamethods.
+ *
+ * A struct is reflected once at global scope with
+ *
+ *   GLUA_FFI_STRUCT(particle, x, y, vx, vy, alive)
+ *
+ * listing every member in declaration order (at most 16). Members
+ * may be arithmetic types, bool, arrays, pointers and other
+ * reflected structs. ffi::cdef<T>() returns the matching C
+ * declaration, ffi::declare<T>(l) passes it to ffi.cdef once per
+ * state and checks that LuaJIT computes the same size and offsets,
+ * and ffi::push(l, ptr) pushes a cdata pointer to *ptr. The pointee
+ * must outlive every use of that pointer in lua.
+ *
+ * declare first declares the reflected structs T contains by value
+ * or in arrays. Structs are referred to by their struct tag, so
+ * pointer members may point to T itself or to structs declared
+ * later.
+ *
+ * Only cdef works without LuaJIT; the rest requires the ffi module.
+ */
+
+namespace glua {
+namespace ffi {
+
+template<typename T>
+inline void declare(lua_State& l);
+
+} // namespace ffi
+
+namespace detail {
+
+/**
+ * Specialized by GLUA_FFI_STRUCT for each reflected struct.
+ */
+template<typename T>
+struct _ffi_struct;
+
+/**
+ * The C declarator for a member of type T called name.
+ */
+template<typename T, typename = void>
+struct _ffi_type {};
+
+template<>
+struct _ffi_type<void> {
+    static inline std::string declare(const std::string& name) { return "void " + name; }
+};
+
+template<>
+struct _ffi_type<bool> {
+    static inline std::string declare(const std::string& name) { return "bool " + name; }
+};
+
+template<>
+struct _ffi_type<char> {
+    static inline std::string declare(const std::string& name) { return "char " + name; }
+};
+
+template<>
+struct _ffi_type<float> {
+    static inline std::string declare(const std::string& name) { return "float " + name; }
+};
+
+template<>
+struct _ffi_type<double> {
+    static inline std::string declare(const std::string& name) { return "double " + name; }
+};
+
+/**
+ * Other integral types are spelled as fixed width types, so the
+ * declaration doesn't depend on the platform's idea of long.
+ */
+template<typename T>
+struct _ffi_type<T, typename std::enable_if<
+    std::is_integral<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value>::type> {
+    static inline std::string declare(const std::string& name) {
+        return std::string(std::is_signed<T>::value ? "int" : "uint") +
+               std::to_string(sizeof(T) * 8) + "_t " + name;
+    }
+};
+
+template<typename T>
+struct _ffi_type<T*> {
+    static inline std::string declare(const std::string& name) {
+        return _ffi_type<typename std::remove_cv<T>::type>::declare("*" + name);
+    }
+};
+
+template<typename T, size_t N>
+struct _ffi_type<T[N]> {
+    static inline std::string declare(const std::string& name) {
+        return _ffi_type<typename std::remove_cv<T>::type>::declare(name + "[" + std::to_string(N) + "]");
+    }
+};
+
+template<typename T>
+struct _ffi_type<T, typename std::enable_if<std::is_class<T>::value>::type> {
+    static inline std::string declare(const std::string& name) {
+        return "struct " + std::string(_ffi_struct<T>::name) + " " + name;
+    }
+};
+
+/**
+ * Adds the declare function of the reflected struct a member of type
+ * T contains, if any, to deps.
+ */
+template<typename T, typename = void>
+struct _ffi_dependency {
+    static inline void add(std::vector<void(*)(lua_State&)>&) {}
+};
+
+template<typename T, size_t N>
+struct _ffi_dependency<T[N]> : public _ffi_dependency<typename std::remove_cv<T>::type> {};
+
+template<typename T>
+struct _ffi_dependency<T, typename std::enable_if<std::is_class<T>::value>::type> {
+    static inline void add(std::vector<void(*)(lua_State&)>& deps) {
+        deps.push_back(&::glua::ffi::declare<T>);
+    }
+};
+
+/**
+ * Collects the member declarations and offsets of a reflected struct.
+ */
+struct _ffi_layout {
+    std::string members;
+    std::vector<std::pair<const char*, size_t>> offsets;
+    std::vector<void(*)(lua_State&)> dependencies;
+
+    template<typename T>
+    inline void add(const char* name, size_t offset) {
+        members += "  " + _ffi_type<typename std::remove_cv<T>::type>::declare(name) + ";\n";
+        offsets.emplace_back(name, offset);
+        _ffi_dependency<typename std::remove_cv<T>::type>::add(dependencies);
+    }
+};
+
+/**
+ * Registry key of the cast function of T, set once T is declared.
+ */
+template<typename T>
+inline const void* _ffi_key() {
+    static const char key = 0;
+    return &key;
+}
+
+/**
+ * Declares the struct, checks its layout and returns a function
+ * casting a light userdata to a pointer to it.
+ */
+constexpr const char* _ffi_declare_source =
+    "local cdef, name, size, offsets = ...\n"
+    "local ffi = require('ffi')\n"
+    "ffi.cdef(cdef)\n"
+    "if ffi.sizeof(name) ~= size then\n"
+    "  error(name .. ': ffi size ' .. ffi.sizeof(name) .. ' differs from C++ size ' .. size)\n"
+    "end\n"
+    "for field, offset in pairs(offsets) do\n"
+    "  if ffi.offsetof(name, field) ~= offset then\n"
+    "    error(name .. '.' .. field .. ': ffi offset differs from C++ offset ' .. offset)\n"
+    "  end\n"
+    "end\n"
+    "local ptr = ffi.typeof(name .. ' *')\n"
+    "return function(p) return ffi.cast(ptr, p) end\n";
+
+} // namespace detail
+
+namespace ffi {
+
+/**
+ * The C declaration of the reflected struct T, for ffi.cdef.
+ */
+template<typename T>
+inline std::string cdef() {
+    static_assert(std::is_standard_layout<T>::value, "ffi structs must have standard layout");
+    ::glua::detail::_ffi_layout layout;
+    ::glua::detail::_ffi_struct<T>::fields(layout);
+    std::string name = ::glua::detail::_ffi_struct<T>::name;
+    return "typedef struct " + name + " " + name + ";\n" +
+           "struct " + name + " {\n" + layout.members + "};\n";
+}
+
+/**
+ * Declare T and the structs it contains to the ffi of state l, if
+ * not done yet. Throws a glua::error if the ffi computes a different
+ * layout.
+ */
+template<typename T>
+inline void declare(lua_State& l) {
+    lua_rawgetp(&l, LUA_REGISTRYINDEX, ::glua::detail::_ffi_key<T>());
+    bool declared = !lua_isnil(&l, -1);
+    lua_pop(&l, 1);
+    if(declared) return;
+
+    ::glua::detail::_ffi_layout layout;
+    ::glua::detail::_ffi_struct<T>::fields(layout);
+    for(auto dependency : layout.dependencies) dependency(l);
+    std::string source = cdef<T>();
+
+    int status = luaL_loadstring(&l, ::glua::detail::_ffi_declare_source);
+    if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+    lua_pushlstring(&l, source.data(), source.size());
+    lua_pushstring(&l, ::glua::detail::_ffi_struct<T>::name);
+    lua_pushinteger(&l, static_cast<lua_Integer>(sizeof(T)));
+    lua_createtable(&l, 0, static_cast<int>(layout.offsets.size()));
+    for(const auto& field : layout.offsets) {
+        lua_pushinteger(&l, static_cast<lua_Integer>(field.second));
+        lua_setfield(&l, -2, field.first);
+    }
+    api::call(l, 4, 1);
+    lua_rawsetp(&l, LUA_REGISTRYINDEX, ::glua::detail::_ffi_key<T>());
+}
+
+/**
+ * Push a cdata pointer to *ptr, declaring T first if needed.
+ */
+template<typename T>
+inline void push(lua_State& l, T* ptr) {
+    declare<T>(l);
+    lua_rawgetp(&l, LUA_REGISTRYINDEX, ::glua::detail::_ffi_key<T>());
+    lua_pushlightuserdata(&l, const_cast<void*>(static_cast<const void*>(ptr)));
+    api::call(l, 1, 1);
+}
+
+} // namespace ffi
+} // namespace glua
+
+#define GLUA_FFI_EXPAND(x) x
+#define GLUA_FFI_CAT(a, b) GLUA_FFI_CAT_(a, b)
+#define GLUA_FFI_CAT_(a, b) a##b
+#define GLUA_FFI_NARGS(...) GLUA_FFI_EXPAND(GLUA_FFI_NARGS_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define GLUA_FFI_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define GLUA_FFI_EACH_1(M, x) M(x)
+#define GLUA_FFI_EACH_2(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_1(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_3(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_2(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_4(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_3(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_5(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_4(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_6(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_5(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_7(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_6(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_8(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_7(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_9(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_8(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_10(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_9(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_11(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_10(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_12(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_11(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_13(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_12(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_14(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_13(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_15(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_14(M, __VA_ARGS__))
+#define GLUA_FFI_EACH_16(M, x, ...) M(x) GLUA_FFI_EXPAND(GLUA_FFI_EACH_15(M, __VA_ARGS__))
+#define GLUA_FFI_FOR_EACH(M, ...) \
+    GLUA_FFI_EXPAND(GLUA_FFI_CAT(GLUA_FFI_EACH_, GLUA_FFI_NARGS(__VA_ARGS__))(M, __VA_ARGS__))
+
+#define GLUA_FFI_FIELD(FIELD) layout.add<decltype(type::FIELD)>(#FIELD, offsetof(type, FIELD));
+
+#define GLUA_FFI_STRUCT(CLASS, ...)                                  \
+namespace glua {                                                      \
+namespace detail {                                                     \
+template<>                                                              \
+struct _ffi_struct<CLASS> {                                              \
+    using type = CLASS;                                                   \
+    static constexpr const char* name = #CLASS;                            \
+    static inline void fields(_ffi_layout& layout) {                        \
+        GLUA_FFI_FOR_EACH(GLUA_FFI_FIELD, __VA_ARGS__)                       \
+    }                                                                         \
+};                                                                             \
+}                                                                               \
+}
@@ -29,11 +29,12 @@ public:
     auto operator()(Args&&... args) 
     -> decltype(api::checkGet<Ret>(l))
     {
+        int base = lua_gettop(&l);
         this->ref::push();
         api::push(l, std::forward<Args>(args)...);
         api::call(l, sizeof...(Args), 1);
         decltype(api::checkGet<Ret>(l)) ret = api::checkGet<Ret>(l);
-        api::clearStack(l);
+        lua_settop(&l, base);
         return ret;
         //return api::checkGet<Ret>(l);
     } 
@@ -69,11 +70,12 @@ public:
     auto operator()(Args&&... args) 
     -> decltype(api::checkGet<Rets...>(l))
     {
+        int base = lua_gettop(&l);
         this->ref::push();
         api::push(l, std::forward<Args>(args)...);
         api::call(l, sizeof...(Args), sizeof...(Rets));
         decltype(api::checkGet<Rets...>(l)) ret = api::checkGet<Rets...>(l);
-        api::clearStack(l);
+        lua_settop(&l, base);
         return ret;
     }
 };
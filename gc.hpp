@@ -0,0 +1,158 @@
+#pragma once
+
+#include <chrono>
+
+#include "api.hpp"
+
+/**
+ * gc.hpp
+ * Contains glua::gc_control, a thin wrapper around lua_gc for
+ * controlling when garbage collection work happens: tuning the
+ * incremental collector, stepping it explicitly, suspending it
+ * around latency-critical sections, and pacing it so a fixed time
+ * budget is spent between requests or frames.
+ *
+ * With lua 5.4 the collector can also be switched between its
+ * incremental and generational modes.
+ */
+
+namespace glua {
+
+class gc_control {
+public:
+    using clock = std::chrono::steady_clock;
+
+    /**
+     * Result of a call to pace().
+     */
+    struct report {
+        clock::duration spent;
+        int steps;
+        bool cycleFinished;
+    };
+
+    /**
+     * Stops the collector for its lifetime and restarts it afterwards
+     * if it was running before.
+     */
+    class pause {
+    public:
+        explicit pause(lua_State& l) : l(l), wasRunning(lua_gc(&l, LUA_GCISRUNNING, 0) != 0) {
+            lua_gc(&l, LUA_GCSTOP, 0);
+        }
+
+        pause(pause&& p) : l(p.l), wasRunning(p.wasRunning) {
+            p.wasRunning = false;
+        }
+
+        pause(const pause&) = delete;
+        pause& operator=(const pause&) = delete;
+
+        ~pause() {
+            if(wasRunning) lua_gc(&l, LUA_GCRESTART, 0);
+        }
+
+    private:
+        lua_State& l;
+        bool wasRunning;
+    };
+
+    explicit gc_control(lua_State& l) : l(l) {}
+
+    /**
+     * Run a full collection cycle.
+     */
+    inline void collect() { lua_gc(&l, LUA_GCCOLLECT, 0); }
+
+    /**
+     * Stop automatic collection; only explicit steps, collect() and
+     * pace() will do collection work.
+     */
+    inline void stop() { lua_gc(&l, LUA_GCSTOP, 0); }
+
+    /**
+     * Restart automatic collection.
+     */
+    inline void restart() { lua_gc(&l, LUA_GCRESTART, 0); }
+
+    inline bool running() const { return lua_gc(&l, LUA_GCISRUNNING, 0) != 0; }
+
+    /**
+     * Stop the collector until the returned object is destroyed.
+     */
+    inline pause suspend() { return pause(l); }
+
+    /**
+     * Memory in use by the state, in bytes.
+     */
+    inline size_t bytes() const {
+        return static_cast<size_t>(lua_gc(&l, LUA_GCCOUNT, 0)) * 1024 +
+               static_cast<size_t>(lua_gc(&l, LUA_GCCOUNTB, 0));
+    }
+
+    /**
+     * Set how long the collector waits before starting a new cycle,
+     * as a percentage of memory in use after the last one.
+     * Returns the previous value.
+     */
+    inline int setPause(int percent) { return lua_gc(&l, LUA_GCSETPAUSE, percent); }
+
+    /**
+     * Set the speed of the collector relative to allocation,
+     * as a percentage. Returns the previous value.
+     */
+    inline int setStepMul(int percent) { return lua_gc(&l, LUA_GCSETSTEPMUL, percent); }
+
+    /**
+     * Perform an incremental step worth roughly kb kilobytes of
+     * allocation (0 for a single basic step). Returns true if the
+     * step finished a collection cycle.
+     */
+    inline bool step(int kb = 0) { return lua_gc(&l, LUA_GCSTEP, kb) != 0; }
+
+#if LUA_VERSION_NUM >= 504
+    /**
+     * Switch to generational mode. minorMul is how much memory may
+     * grow, as a percentage, before a minor collection; majorMul how
+     * much before a major one. 0 keeps the current value. Returns
+     * true if the collector was already in generational mode.
+     */
+    inline bool generational(int minorMul = 0, int majorMul = 0) {
+        return lua_gc(&l, LUA_GCGEN, minorMul, majorMul) == LUA_GCGEN;
+    }
+
+    /**
+     * Switch to incremental mode, optionally setting the pause, step
+     * multiplier and step size (log2 of bytes); 0 keeps the current
+     * value. Returns true if the collector was in generational mode.
+     */
+    inline bool incremental(int pause = 0, int stepMul = 0, int stepSize = 0) {
+        return lua_gc(&l, LUA_GCINC, pause, stepMul, stepSize) == LUA_GCGEN;
+    }
+#endif
+
+    /**
+     * Perform incremental steps of stepKb until the time budget is
+     * spent or a cycle finishes. The last step may overrun the budget
+     * by the time of one step.
+     */
+    template<typename Rep, typename Period>
+    inline report pace(std::chrono::duration<Rep, Period> budget, int stepKb = 8) {
+        clock::time_point start = clock::now();
+        clock::time_point end = start + std::chrono::duration_cast<clock::duration>(budget);
+        report r{clock::duration::zero(), 0, false};
+        clock::time_point now = start;
+        while(now < end && !r.cycleFinished) {
+            r.cycleFinished = step(stepKb);
+            ++r.steps;
+            now = clock::now();
+        }
+        r.spent = now - start;
+        return r;
+    }
+
+private:
+    lua_State& l;
+};
+
+} // namespace glua
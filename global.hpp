@@ -7,14 +7,15 @@ namespace glua {
 
 class global : public selector<const char*> {
 public:
-    inline global(const global& g) : selector<const char*>(g.l, g.key) {}
-    // On destruction of the first selector, clear the stack.
-    // This works because the destructor is guaranteed to be
-    // called after fully evaluating the expression in which
-    // a temporary object was created, which in this case is
-    // exactly where we want to clear the stack.
+    inline global(const global& g) : selector<const char*>(g.l, g.key), base(g.base) {}
+    // On destruction of the first selector, reset the stack to
+    // where it was when the selector was created. This works
+    // because the destructor is guaranteed to be called after
+    // fully evaluating the expression in which a temporary object
+    // was created, which in this case is exactly where we want to
+    // clean up the stack.
     inline virtual ~global() {
-        api::clearStack(l);
+        if(lua_gettop(&l) > base) lua_settop(&l, base);
     }
 
     inline virtual void push() {
@@ -28,7 +29,11 @@ public:
     inline void operator=(T val) { set(val); }
 private:
     friend class state;
-    inline global(lua_State& l, const char* key) : selector<const char*>(l, std::forward<const char*>(key)) {}
+    friend class stack_ref;
+    inline global(lua_State& l, const char* key)
+    : selector<const char*>(l, std::forward<const char*>(key)), base(lua_gettop(&l)) {}
+
+    int base;
 };
 
 } // namespace glua
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdexcept>
+
+#include "api.hpp"
+
+/**
+ * hooks.hpp
+ * Lua only allows one hook per thread, so every glua feature which
+ * needs a count hook (the profiler, execution budgets) registers a
+ * callback here instead of calling lua_sethook directly. The
+ * dispatcher installs a single count hook firing after the smallest
+ * remaining interval and runs each callback once its own interval
+ * has elapsed. With no callbacks registered no hook is installed.
+ *
+ * Lua restarts the count whenever the hook is reinstalled, so adding
+ * or removing a callback can delay the others by up to one interval.
+ * Coroutines inherit the hook of the thread that created them and
+ * are charged to that thread's dispatcher.
+ */
+
+namespace glua {
+namespace detail {
+
+class _hooks {
+public:
+    /**
+     * Callback run from the hook. Returning true makes the running
+     * coroutine yield (count hooks may only yield zero values, and
+     * under LuaJIT not at all). Callbacks may also raise lua errors.
+     */
+    using callback = bool(*)(lua_State* l, void* ctx);
+
+    static constexpr int max_entries = 8;
+    static constexpr const char* metatable = "glua.hooks";
+
+    /**
+     * Get the dispatcher for thread l, creating it if necessary.
+     */
+    static inline _hooks& get(lua_State& l) {
+        _hooks* h = find(&l);
+        if(h != nullptr) return *h;
+        h = static_cast<_hooks*>(lua_newuserdata(&l, sizeof(_hooks)));
+        if(h == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+        new (h) _hooks();
+        if(luaL_newmetatable(&l, metatable)) {
+            lua_pushcfunction(&l, &gc);
+            lua_setfield(&l, -2, "__gc");
+        }
+        lua_setmetatable(&l, -2);
+        lua_rawsetp(&l, LUA_REGISTRYINDEX, &l);
+        return *h;
+    }
+
+    /**
+     * Register cb to run every interval instructions on thread l.
+     * Returns an id for remove.
+     */
+    static inline int add(lua_State& l, callback cb, void* ctx, int interval) {
+        _hooks& h = get(l);
+        if(h.count == max_entries) throw std::runtime_error("Error: too many lua hooks installed");
+        if(interval < 1) interval = 1;
+        h.entries[h.count++] = entry{h.nextId, cb, ctx, interval, interval};
+        h.install(l);
+        return h.nextId++;
+    }
+
+    /**
+     * Unregister the callback with the given id from thread l.
+     */
+    static inline void remove(lua_State& l, int id) {
+        _hooks* h = find(&l);
+        if(h == nullptr) return;
+        for(int i = 0; i < h->count; ++i) {
+            if(h->entries[i].id == id) {
+                h->entries[i] = h->entries[--h->count];
+                break;
+            }
+        }
+        if(h->count == 0) {
+            lua_sethook(&l, nullptr, 0, 0);
+            lua_pushnil(&l);
+            lua_rawsetp(&l, LUA_REGISTRYINDEX, &l);
+            return;
+        }
+        h->install(l);
+    }
+
+    /**
+     * Change the interval of the callback with the given id, starting
+     * its count again. May be called from the callback itself.
+     */
+    static inline void setInterval(lua_State& l, int id, int interval) {
+        _hooks* h = dispatcher(&l);
+        if(h == nullptr) return;
+        if(interval < 1) interval = 1;
+        for(int i = 0; i < h->count; ++i) {
+            if(h->entries[i].id == id) {
+                h->entries[i].interval = interval;
+                h->entries[i].remaining = interval;
+                break;
+            }
+        }
+        h->install(l);
+    }
+
+private:
+    struct entry {
+        int id;
+        callback cb;
+        void* ctx;
+        int interval;
+        int remaining;
+    };
+
+    _hooks() : count(0), installed(0), nextId(1) {}
+
+    /**
+     * Find the dispatcher of thread (l itself by default).
+     */
+    static inline _hooks* find(lua_State* l, const lua_State* thread = nullptr) {
+        lua_rawgetp(l, LUA_REGISTRYINDEX, thread != nullptr ? thread : l);
+        _hooks* h = static_cast<_hooks*>(lua_touserdata(l, -1));
+        lua_pop(l, 1);
+        return h;
+    }
+
+    /**
+     * The dispatcher charged for thread l: its own, or else that of
+     * the main thread.
+     */
+    static inline _hooks* dispatcher(lua_State* l) {
+        _hooks* h = find(l);
+        if(h == nullptr) {
+            lua_State* main = _main_thread(l);
+            if(main != nullptr && main != l) h = find(l, main);
+        }
+        return h;
+    }
+
+    inline void install(lua_State& l) {
+        int next = entries[0].remaining;
+        for(int i = 1; i < count; ++i) if(entries[i].remaining < next) next = entries[i].remaining;
+        if(next < 1) next = 1;
+        installed = next;
+        lua_sethook(&l, &hook, LUA_MASKCOUNT, next);
+    }
+
+    static void hook(lua_State* l, lua_Debug*) {
+        _hooks* h = dispatcher(l);
+        if(h == nullptr) return;
+        int elapsed = h->installed;
+        entry due[max_entries];
+        int ndue = 0;
+        for(int i = 0; i < h->count; ++i) {
+            entry& e = h->entries[i];
+            e.remaining -= elapsed;
+            if(e.remaining <= 0) {
+                e.remaining = e.interval;
+                due[ndue++] = e;
+            }
+        }
+        // Reinstall before running callbacks, since they may raise errors
+        h->install(*l);
+        bool yield = false;
+        for(int i = 0; i < ndue; ++i) yield = due[i].cb(l, due[i].ctx) || yield;
+#ifndef GLUA_LUAJIT
+        if(yield) lua_yield(l, 0);
+#endif
+    }
+
+    static int gc(lua_State* l) {
+        static_cast<_hooks*>(lua_touserdata(l, 1))->~_hooks();
+        return 0;
+    }
+
+    entry entries[max_entries];
+    int count;
+    int installed;
+    int nextId;
+};
+
+} // namespace detail
+} // namespace glua
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "api.hpp"
+
+/**
+ * libs.hpp
+ * Selective opening of the standard libraries. A state can open only
+ * the libraries in a mask, and can defer others until a script first
+ * reads their global: the table of globals gets an __index
+ * metamethod which opens the library on first access. Libraries
+ * which are never touched cost neither memory nor start-up time.
+ *
+ * Lazy libraries are reached through _G only, so require("io")
+ * before io has been touched fails. string is always opened eagerly
+ * when requested, since its functions are also reached through the
+ * string metatable, and so is base, which has no table of its own.
+ * If all lazy libraries have been opened, the metatable of _G is
+ * removed again.
+ */
+
+namespace glua {
+namespace lib {
+
+enum mask : unsigned {
+    none      = 0,
+    base      = 1u << 0,
+    package   = 1u << 1,
+    coroutine = 1u << 2,
+    table     = 1u << 3,
+    io        = 1u << 4,
+    os        = 1u << 5,
+    string    = 1u << 6,
+    math      = 1u << 7,
+    utf8      = 1u << 8,
+    bit       = 1u << 9,    // bit32 on 5.2, bit on LuaJIT
+    debug     = 1u << 10,
+    jit       = 1u << 11,   // LuaJIT only
+    ffi       = 1u << 12,   // LuaJIT only
+    all       = ~0u
+};
+
+inline constexpr mask operator|(mask a, mask b) {
+    return static_cast<mask>(static_cast<unsigned>(a) | static_cast<unsigned>(b));
+}
+
+inline constexpr mask operator&(mask a, mask b) {
+    return static_cast<mask>(static_cast<unsigned>(a) & static_cast<unsigned>(b));
+}
+
+inline constexpr mask operator~(mask a) {
+    return static_cast<mask>(~static_cast<unsigned>(a));
+}
+
+} // namespace lib
+
+namespace detail {
+
+struct _lib_entry {
+    lib::mask bit;
+    const char* name;
+    lua_CFunction open;
+};
+
+/**
+ * The libraries available in this lua version, in the order
+ * luaL_openlibs opens them; terminated by a null entry.
+ */
+inline const _lib_entry* _lib_entries() {
+    static const _lib_entry entries[] = {
+        {lib::base,      "_G",            &luaopen_base},
+        {lib::package,   LUA_LOADLIBNAME, &luaopen_package},
+#ifndef GLUA_LUAJIT
+        {lib::coroutine, LUA_COLIBNAME,   &luaopen_coroutine},
+#endif
+        {lib::table,     LUA_TABLIBNAME,  &luaopen_table},
+        {lib::io,        LUA_IOLIBNAME,   &luaopen_io},
+        {lib::os,        LUA_OSLIBNAME,   &luaopen_os},
+        {lib::string,    LUA_STRLIBNAME,  &luaopen_string},
+        {lib::math,      LUA_MATHLIBNAME, &luaopen_math},
+#ifdef LUA_UTF8LIBNAME
+        {lib::utf8,      LUA_UTF8LIBNAME, &luaopen_utf8},
+#endif
+#if defined(GLUA_LUAJIT)
+        {lib::bit,       LUA_BITLIBNAME,  &luaopen_bit},
+#elif LUA_VERSION_NUM == 502
+        {lib::bit,       LUA_BITLIBNAME,  &luaopen_bit32},
+#endif
+        {lib::debug,     LUA_DBLIBNAME,   &luaopen_debug},
+#ifdef LUA_JITLIBNAME
+        {lib::jit,       LUA_JITLIBNAME,  &luaopen_jit},
+#endif
+#ifdef LUA_FFILIBNAME
+        {lib::ffi,       LUA_FFILIBNAME,  &luaopen_ffi},
+#endif
+        {lib::none,      nullptr,         nullptr}
+    };
+    return entries;
+}
+
+/**
+ * __index of _G while lazy libraries remain. Upvalue 1 maps the
+ * name of each unopened library to its luaopen function.
+ */
+inline int _lazy_lib_index(lua_State* l) {
+    lua_pushvalue(l, 2);
+    lua_rawget(l, lua_upvalueindex(1));
+    lua_CFunction open = lua_tocfunction(l, -1);
+    lua_pop(l, 1);
+    if(open == nullptr) return 0;
+
+    lua_pushvalue(l, 2);
+    lua_pushnil(l);
+    lua_rawset(l, lua_upvalueindex(1));
+    lua_pushnil(l);
+    if(!lua_next(l, lua_upvalueindex(1))) {
+        lua_pushnil(l);
+        lua_setmetatable(l, 1);
+    } else {
+        lua_pop(l, 2);
+    }
+
+    _open_lib(l, lua_tostring(l, 2), open);
+    return 1;
+}
+
+} // namespace detail
+
+namespace api {
+
+/**
+ * Open the standard libraries in eager now, and those in lazy on
+ * first access through _G.
+ */
+inline void openLibs(lua_State& l, lib::mask eager, lib::mask lazy = lib::none) {
+    // base and string can't be lazy, see above
+    eager = eager | (lazy & (lib::base | lib::string));
+    lazy = lazy & ~eager;
+    int deferred = 0;
+    for(const ::glua::detail::_lib_entry* e = ::glua::detail::_lib_entries(); e->name != nullptr; ++e) {
+        if(eager & e->bit) {
+            ::glua::detail::_open_lib(&l, e->name, e->open);
+            lua_pop(&l, 1);
+        } else if(lazy & e->bit) {
+            if(deferred++ == 0) lua_newtable(&l);
+            lua_pushcfunction(&l, e->open);
+            lua_setfield(&l, -2, e->name);
+        }
+    }
+    if(deferred == 0) return;
+
+    lua_pushcclosure(&l, &::glua::detail::_lazy_lib_index, 1);
+    ::glua::detail::_push_globals(&l);
+    lua_newtable(&l);
+    lua_pushvalue(&l, -3);
+    lua_setfield(&l, -2, "__index");
+    lua_setmetatable(&l, -2);
+    lua_pop(&l, 2);
+}
+
+} // namespace api
+} // namespace glua
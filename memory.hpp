@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "api.hpp"
+#include "hooks.hpp"
+
+/**
+ * memory.hpp
+ * Contains glua::allocator, a lua_Alloc implementation which keeps
+ * per-state memory accounting (live bytes, peak bytes, number of
+ * allocations), enforces an optional hard limit, and can attribute
+ * allocated bytes to the lua source line that was running.
+ *
+ * When the limit would be exceeded the allocation fails, which lua
+ * reports as a "not enough memory" error in the offending script
+ * rather than letting the process grow until it is killed.
+ *
+ * The allocator itself only counts bytes: lua calls it while stacks
+ * are being moved, when the debug api can't be used. Site profiling
+ * instead installs a count hook which, between instructions, charges
+ * the bytes allocated since the previous hook to the line that was
+ * running then, so attribution is exact with an interval of one
+ * instruction and sampled with longer ones.
+ */
+
+namespace glua {
+
+class allocator {
+public:
+    allocator() : owner(nullptr), liveBytes(0), peakBytes(0), count(0), maxBytes(0), pending(0), hookId(0) {}
+
+    allocator(const allocator&) = delete;
+    allocator& operator=(const allocator&) = delete;
+
+    /**
+     * The lua_Alloc function; ud must point to an allocator.
+     */
+    static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize) noexcept {
+        allocator& self = *static_cast<allocator*>(ud);
+        // For new blocks lua passes the object type in osize
+        if(ptr == nullptr) osize = 0;
+        if(nsize == 0) {
+            std::free(ptr);
+            self.liveBytes -= osize;
+            return nullptr;
+        }
+        if(nsize > osize && self.maxBytes != 0 && self.liveBytes - osize + nsize > self.maxBytes) {
+            return nullptr;
+        }
+        void* ret = std::realloc(ptr, nsize);
+        if(ret == nullptr) return nullptr;
+        self.liveBytes = self.liveBytes - osize + nsize;
+        if(self.liveBytes > self.peakBytes) self.peakBytes = self.liveBytes;
+        if(osize == 0) ++self.count;
+        if(nsize > osize) self.pending += nsize - osize;
+        return ret;
+    }
+
+    /**
+     * Bytes currently allocated by the state.
+     */
+    inline size_t live() const { return liveBytes; }
+
+    /**
+     * Highest value live() has reached.
+     */
+    inline size_t peak() const { return peakBytes; }
+
+    /**
+     * Number of blocks allocated so far (reallocations not counted).
+     */
+    inline size_t allocations() const { return count; }
+
+    /**
+     * Set the maximum number of live bytes; 0 means no limit.
+     */
+    inline void setLimit(size_t bytes) { maxBytes = bytes; }
+    inline size_t limit() const { return maxBytes; }
+
+    inline void resetPeak() { peakBytes = liveBytes; }
+
+    /**
+     * Enable or disable attribution of allocated bytes to source
+     * lines, sampled once every interval lua instructions. Requires
+     * an attached state.
+     */
+    inline void profileSites(bool enable, int interval = 1) {
+        if(hookId != 0) {
+            detail::_hooks::remove(*owner, hookId);
+            hookId = 0;
+        }
+        if(!enable) return;
+        if(owner == nullptr) throw std::runtime_error("Error: allocator has no attached state");
+        site.assign("[C]");
+        pending = 0;
+        hookId = detail::_hooks::add(*owner, &sample, this, interval);
+    }
+
+    inline bool profilingSites() const { return hookId != 0; }
+
+    /**
+     * Bytes allocated at each "source:line" since profiling started.
+     * Allocations made outside any lua function are under "[C]".
+     */
+    inline const std::unordered_map<std::string, size_t>& sites() const { return bySite; }
+
+    inline void clearSites() { bySite.clear(); }
+
+    /**
+     * Set the state whose hook is used for site attribution.
+     */
+    inline void attach(lua_State& l) { owner = &l; }
+
+private:
+    /**
+     * Charge the bytes allocated since the last sample to the site
+     * recorded then, and record the line thread l is running now.
+     * Running in a hook, it must not throw; a failed insertion just
+     * loses the sample.
+     */
+    static bool sample(lua_State* l, void* ctx) {
+        allocator& self = *static_cast<allocator*>(ctx);
+        try {
+            if(self.pending != 0) self.bySite[self.site] += self.pending;
+            self.pending = 0;
+            lua_Debug ar;
+            if(lua_getstack(l, 0, &ar) && lua_getinfo(l, "Sl", &ar) && ar.currentline > 0) {
+                self.site.assign(ar.short_src);
+                self.site.push_back(':');
+                self.site += std::to_string(ar.currentline);
+            } else {
+                self.site.assign("[C]");
+            }
+        } catch(const std::exception&) {
+            self.pending = 0;
+        }
+        return false;
+    }
+
+    lua_State* owner;
+    size_t liveBytes;
+    size_t peakBytes;
+    size_t count;
+    size_t maxBytes;
+    size_t pending;
+    int hookId;
+    std::string site;
+    std::unordered_map<std::string, size_t> bySite;
+};
+
+} // namespace glua
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "api.hpp"
+
+/**
+ * metrics.hpp
+ * Opt-in per-binding call metrics for functions registered through
+ * state::registerFunction. Define GLUA_METRICS before including any
+ * glua header to enable them; otherwise the timing hooks used by the
+ * cfunction/cfunctor wrappers are empty and compile away entirely.
+ *
+ * For every registered name the wrappers record the number of calls,
+ * the cumulative time split into marshalling (reading arguments and
+ * pushing results) and body time, and a latency histogram from which
+ * percentiles are derived. metrics::snapshot() returns a copy of all
+ * counters.
+ */
+
+#ifdef GLUA_METRICS
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace glua {
+namespace metrics {
+
+/**
+ * Log-linear latency histogram in the style of HDR histograms:
+ * one group per power of two, each split into 8 linear sub-buckets,
+ * giving a relative error of at most 12.5% over the full range of
+ * uint64_t nanoseconds. Recording is a single relaxed atomic add.
+ */
+class histogram {
+public:
+    static constexpr int sub_bits = 3;
+    static constexpr int sub_buckets = 1 << sub_bits;
+    static constexpr int nbuckets = (64 - sub_bits + 1) * sub_buckets;
+
+    histogram() {
+        for(auto& b : buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+    inline void record(uint64_t value) {
+        buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Approximate value below which the fraction p of the
+     * recorded values fall (p in [0, 1]).
+     */
+    inline uint64_t percentile(double p) const {
+        uint64_t counts[nbuckets];
+        uint64_t total = 0;
+        for(int i = 0; i < nbuckets; ++i) total += counts[i] = buckets[i].load(std::memory_order_relaxed);
+        if(total == 0) return 0;
+        uint64_t target = static_cast<uint64_t>(p * total + 0.5);
+        if(target == 0) target = 1;
+        uint64_t seen = 0;
+        for(int i = 0; i < nbuckets; ++i) {
+            seen += counts[i];
+            if(seen >= target) return upper(i);
+        }
+        return upper(nbuckets - 1);
+    }
+
+    inline void reset() {
+        for(auto& b : buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    static inline int msb(uint64_t v) {
+#if defined(__GNUC__)
+        return 63 - __builtin_clzll(v);
+#else
+        int r = 0;
+        while(v >>= 1) ++r;
+        return r;
+#endif
+    }
+
+    static inline int index(uint64_t v) {
+        if(v < sub_buckets) return static_cast<int>(v);
+        int shift = msb(v) - sub_bits;
+        return (shift + 1) * sub_buckets + static_cast<int>((v >> shift) & (sub_buckets - 1));
+    }
+
+    static inline uint64_t upper(int i) {
+        if(i < sub_buckets) return static_cast<uint64_t>(i);
+        int shift = i / sub_buckets - 1;
+        uint64_t base = uint64_t(sub_buckets + i % sub_buckets) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
+    }
+
+    std::atomic<uint64_t> buckets[nbuckets];
+};
+
+/**
+ * Live counters for one registered name.
+ */
+struct binding_stats {
+    explicit binding_stats(std::string name) : name(std::move(name)) {
+        reset();
+    }
+
+    inline void reset() {
+        calls.store(0, std::memory_order_relaxed);
+        total_ns.store(0, std::memory_order_relaxed);
+        marshal_ns.store(0, std::memory_order_relaxed);
+        body_ns.store(0, std::memory_order_relaxed);
+        latency.reset();
+    }
+
+    const std::string name;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> marshal_ns;
+    std::atomic<uint64_t> body_ns;
+    histogram latency;
+};
+
+/**
+ * Point-in-time copy of binding_stats.
+ */
+struct binding_snapshot {
+    std::string name;
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t marshal_ns;
+    uint64_t body_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+};
+
+/**
+ * Process-wide table of binding_stats keyed by registered name.
+ * Entries are never removed, so the pointers handed to the wrappers
+ * stay valid for the lifetime of the program.
+ */
+class registry {
+public:
+    static inline registry& instance() {
+        static registry r;
+        return r;
+    }
+
+    inline binding_stats& get(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = stats.find(name);
+        if(it == stats.end()) {
+            it = stats.emplace(name, std::unique_ptr<binding_stats>(new binding_stats(name))).first;
+        }
+        return *it->second;
+    }
+
+    inline std::vector<binding_snapshot> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<binding_snapshot> ret;
+        ret.reserve(stats.size());
+        for(const auto& s : stats) {
+            const binding_stats& b = *s.second;
+            ret.push_back(binding_snapshot{
+                b.name,
+                b.calls.load(std::memory_order_relaxed),
+                b.total_ns.load(std::memory_order_relaxed),
+                b.marshal_ns.load(std::memory_order_relaxed),
+                b.body_ns.load(std::memory_order_relaxed),
+                b.latency.percentile(0.50),
+                b.latency.percentile(0.99)
+            });
+        }
+        return ret;
+    }
+
+    inline void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto& s : stats) s.second->reset();
+    }
+
+private:
+    registry() {}
+
+    std::mutex mutex;
+    std::map<std::string, std::unique_ptr<binding_stats>> stats;
+};
+
+/**
+ * Get a copy of the metrics of every registered binding.
+ */
+inline std::vector<binding_snapshot> snapshot() {
+    return registry::instance().snapshot();
+}
+
+/**
+ * Zero every counter.
+ */
+inline void reset() {
+    registry::instance().reset();
+}
+
+} // namespace metrics
+
+namespace detail {
+
+/**
+ * Push the stats of binding name as an upvalue for its wrapper.
+ * Returns the number of values pushed.
+ */
+inline int _push_binding_stats(lua_State& l, const char* name) {
+    lua_pushlightuserdata(&l, &metrics::registry::instance().get(name));
+    return 1;
+}
+
+/**
+ * Timer used inside the generated wrappers. The wrapper marks the
+ * end of argument marshalling, the end of the call, and finally the
+ * end of result marshalling.
+ */
+class _call_timer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    inline _call_timer(lua_State* l, int upvalue)
+    : stats(static_cast<metrics::binding_stats*>(lua_touserdata(l, lua_upvalueindex(upvalue)))),
+      start(clock::now())
+    {}
+
+    inline void argsDone() { args = clock::now(); }
+    inline void bodyDone() { body = clock::now(); }
+
+    inline void done() {
+        if(stats == nullptr) return;
+        clock::time_point end = clock::now();
+        uint64_t total = ns(end - start);
+        uint64_t inner = ns(body - args);
+        stats->calls.fetch_add(1, std::memory_order_relaxed);
+        stats->total_ns.fetch_add(total, std::memory_order_relaxed);
+        stats->body_ns.fetch_add(inner, std::memory_order_relaxed);
+        stats->marshal_ns.fetch_add(total - inner, std::memory_order_relaxed);
+        stats->latency.record(total);
+    }
+
+private:
+    static inline uint64_t ns(clock::duration d) {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    }
+
+    metrics::binding_stats* stats;
+    clock::time_point start, args, body;
+};
+
+} // namespace detail
+} // namespace glua
+
+#else // GLUA_METRICS
+
+namespace glua {
+namespace detail {
+
+inline int _push_binding_stats(lua_State&, const char*) {
+    return 0;
+}
+
+class _call_timer {
+public:
+    inline _call_timer(lua_State*, int) {}
+    inline void argsDone() {}
+    inline void bodyDone() {}
+    inline void done() {}
+};
+
+} // namespace detail
+} // namespace glua
+
+#endif // GLUA_METRICS
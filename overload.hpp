@@ -0,0 +1,358 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#include "api.hpp"
+#include "cfunction.hpp"
+
+/**
+ * overload.hpp
+ * Overload sets: several functions or functors registered under one
+ * name. The generated wrapper picks the first candidate whose arity
+ * equals lua_gettop (or exceeds it only by trailing std::optional
+ * parameters) and whose parameters match the lua_type of each
+ * argument. Arity and expected types are compile-time constants, so
+ * the dispatch compiles down to a chain of integer comparisons with no
+ * dynamic lookup.
+ *
+ * Matching is by lua type: numbers match any arithmetic parameter,
+ * strings match std::string and const char*, and userdata match
+ * class, reference and pointer parameters of a type registered with
+ * GLUA_REGISTER only if they hold that type. Enums match
+ * numbers, and strings too if they are named with GLUA_ENUM;
+ * optionals also match nil, and variants match the types of any of
+ * their alternatives. Candidates are tried in registration order,
+ * so list more specific ones first.
+ *
+ * With GLUA_METRICS, an overload set is timed as a whole and all
+ * of its time is reported as body time.
+ */
+
+namespace glua {
+namespace detail {
+
+/**
+ * The lua type expected for a parameter of type T.
+ * Everything without a native mapping is passed as userdata.
+ */
+template<typename T, typename = void>
+struct _lua_type_of {
+    static constexpr int value = LUA_TUSERDATA;
+};
+
+template<typename T>
+struct _lua_type_of<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+    static constexpr int value = LUA_TNUMBER;
+};
+
+template<>
+struct _lua_type_of<bool> {
+    static constexpr int value = LUA_TBOOLEAN;
+};
+
+template<>
+struct _lua_type_of<std::string> {
+    static constexpr int value = LUA_TSTRING;
+};
+
+template<>
+struct _lua_type_of<const char*> {
+    static constexpr int value = LUA_TSTRING;
+};
+
+#ifdef GLUA_STRING_VIEW
+template<>
+struct _lua_type_of<std::string_view> {
+    static constexpr int value = LUA_TSTRING;
+};
+#endif
+
+template<>
+struct _lua_type_of<std::nullptr_t> {
+    static constexpr int value = LUA_TNIL;
+};
+
+/**
+ * The set of lua types accepted for a parameter of type T, as a
+ * mask of 1 << type.
+ */
+template<typename T, typename = void>
+struct _lua_type_mask {
+    static constexpr unsigned value = 1u << _lua_type_of<T>::value;
+};
+
+template<typename T>
+struct _lua_type_mask<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    static constexpr unsigned value = (1u << LUA_TNUMBER) | (enum_traits<T>::named ? 1u << LUA_TSTRING : 0u);
+};
+
+#ifdef GLUA_VARIANT
+template<>
+struct _lua_type_mask<std::monostate> {
+    static constexpr unsigned value = 1u << LUA_TNIL;
+};
+
+template<typename T>
+struct _lua_type_mask<std::optional<T>> {
+    static constexpr unsigned value = (1u << LUA_TNIL) | _lua_type_mask<T>::value;
+};
+
+template<typename... T>
+struct _lua_type_mask<std::variant<T...>> {
+    static constexpr unsigned value = (_lua_type_mask<T>::value | ...);
+};
+#endif
+
+template<typename T, typename = void>
+struct _has_type_name : std::false_type {};
+
+template<typename T>
+struct _has_type_name<T, decltype((void)type_traits<T>::name)> : std::true_type {};
+
+/**
+ * Whether the userdata at index holds what a parameter of type Arg
+ * takes. Only parameters of registered types are checked; the lua
+ * type is enough for everything else.
+ */
+template<typename Arg, typename = void>
+struct _userdata_match {
+    static inline bool check(lua_State*, int) { return true; }
+};
+
+template<typename T>
+struct _userdata_match<T, typename std::enable_if<_has_type_name<T>::value>::type> {
+    static inline bool check(lua_State* l, int index) {
+        return api::testUserdata<T>(*l, index) != nullptr;
+    }
+};
+
+template<typename T>
+struct _userdata_match<const T&> : public _userdata_match<T> {};
+
+template<typename T>
+struct _userdata_match<T&> {
+    static inline bool check(lua_State* l, int index) {
+        T** p = api::testUserdata<T*>(*l, index);
+        return (p != nullptr && *p != nullptr) || _userdata_match<T>::check(l, index);
+    }
+};
+
+/**
+ * Check _userdata_match for the first top of the parameters Args,
+ * starting at index I.
+ */
+template<int I, typename... Args>
+struct _userdata_args {
+    static inline bool check(lua_State*, int) { return true; }
+};
+
+template<int I, typename Arg, typename... Rest>
+struct _userdata_args<I, Arg, Rest...> {
+    static inline bool check(lua_State* l, int top) {
+        if(I >= top) return true;
+        return _userdata_match<Arg>::check(l, I + 1) && _userdata_args<I + 1, Rest...>::check(l, top);
+    }
+};
+
+/**
+ * Check that the arguments on the stack have lua types accepted
+ * by the parameter list Tuple, and that there are as many as it has
+ * parameters, less any of its trailing optionals.
+ */
+template<typename Tuple>
+struct _args_match {};
+
+template<>
+struct _args_match<std::tuple<>> {
+    static inline bool check(lua_State*, int top) { return top == 0; }
+};
+
+template<typename... Args>
+struct _args_match<std::tuple<Args...>> {
+    static inline bool check(lua_State* l, int top) {
+        static constexpr unsigned expected[] = { _lua_type_mask<typename std::decay<Args>::type>::value... };
+        if(top < api::detail::_required_args<Args...>::value || top > int(sizeof...(Args))) return false;
+        for(int i = 0; i < top; ++i) {
+            if(!((expected[i] >> lua_type(l, i + 1)) & 1u)) return false;
+        }
+        return _userdata_args<0, Args...>::check(l, top);
+    }
+};
+
+/**
+ * Call f with args, then replace the stack with its results.
+ */
+template<typename Ret>
+struct _call_and_push {
+    template<typename F, typename Tuple>
+    static inline int call(lua_State* l, F& f, Tuple&& args) {
+        Ret val = call_with_tuple(f, std::forward<Tuple>(args));
+        api::clearStack(*l);
+        api::push<Ret>(*l, std::move(val));
+        return function_traits<F>::nrets;
+    }
+};
+
+/**
+ * Pushes each of its arguments.
+ */
+struct _push_values {
+    lua_State* l;
+
+    template<typename... T>
+    inline void operator()(T... vals) const {
+        api::push<T...>(*l, std::move(vals)...);
+    }
+};
+
+/**
+ * Tuples are returned to lua as one value per element.
+ */
+template<typename... R>
+struct _call_and_push<std::tuple<R...>> {
+    template<typename F, typename Tuple>
+    static inline int call(lua_State* l, F& f, Tuple&& args) {
+        std::tuple<R...> vals = call_with_tuple(f, std::forward<Tuple>(args));
+        api::clearStack(*l);
+        call_with_tuple(_push_values{l}, std::move(vals));
+        return function_traits<F>::nrets;
+    }
+};
+
+template<>
+struct _call_and_push<void> {
+    template<typename F, typename Tuple>
+    static inline int call(lua_State* l, F& f, Tuple&& args) {
+        call_with_tuple(f, std::forward<Tuple>(args));
+        api::clearStack(*l);
+        return 0;
+    }
+};
+
+inline int _no_overload(lua_State* l, int top) {
+    return luaL_error(l, "no overload accepts these %d argument(s)", top);
+}
+
+/**
+ * Dispatch over a list of cfunction<...> candidates.
+ */
+template<typename... Candidates>
+struct _cfunction_dispatch {
+    static inline int call(lua_State* l, int top) {
+        return _no_overload(l, top);
+    }
+};
+
+template<typename FuncT, FuncT func, typename... Rest>
+struct _cfunction_dispatch<cfunction<FuncT, func>, Rest...> {
+    using traits = function_traits<FuncT>;
+
+    static inline int call(lua_State* l, int top) {
+        if(_args_match<typename traits::argument_types>::check(l, top)) {
+            FuncT f = func;
+            return _call_and_push<typename traits::return_type>::call(
+                l, f, api::checkArgs<typename traits::argument_types>(*l));
+        }
+        return _cfunction_dispatch<Rest...>::call(l, top);
+    }
+};
+
+/**
+ * Dispatch over the functors stored in a tuple, starting at index I.
+ */
+template<size_t I, typename Tuple, bool = (I < std::tuple_size<Tuple>::value)>
+struct _functor_dispatch {
+    static inline int call(lua_State* l, Tuple&, int top) {
+        return _no_overload(l, top);
+    }
+};
+
+template<size_t I, typename Tuple>
+struct _functor_dispatch<I, Tuple, true> {
+    using functor = typename std::tuple_element<I, Tuple>::type;
+    using traits  = function_traits<functor>;
+
+    static inline int call(lua_State* l, Tuple& functors, int top) {
+        if(_args_match<typename traits::argument_types>::check(l, top)) {
+            return _call_and_push<typename traits::return_type>::call(
+                l, std::get<I>(functors), api::checkArgs<typename traits::argument_types>(*l));
+        }
+        return _functor_dispatch<I + 1, Tuple>::call(l, functors, top);
+    }
+};
+
+} // namespace detail
+
+/**
+ * Overload set of compile-time functions, each given as a
+ * cfunction<decltype(&f), &f>.
+ */
+template<typename... Candidates>
+class overload {
+public:
+    static inline int wrapper(lua_State* l) {
+        return detail::_protect<&invoke>(l);
+    }
+
+private:
+    static inline int invoke(lua_State* l) {
+        detail::_call_timer timer(l, 1);
+        timer.argsDone();
+        int n = detail::_cfunction_dispatch<Candidates...>::call(l, lua_gettop(l));
+        timer.bodyDone();
+        timer.done();
+        return n;
+    }
+};
+
+/**
+ * Overload set of functors, stored together in one userdata.
+ */
+template<typename... Functors>
+class functor_overload {
+public:
+    using tuple_type = std::tuple<Functors...>;
+
+    static inline void push(lua_State& l, tuple_type functors, const char* name = "functor_overload") {
+        tuple_type* fs = static_cast<tuple_type*>(lua_newuserdata(&l, sizeof(tuple_type)));
+        if(fs == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+        new (fs) tuple_type(std::move(functors));
+        // One metatable per tuple type, since __gc has to know it
+        lua_rawgetp(&l, LUA_REGISTRYINDEX, api::detail::_type_key<tuple_type>());
+        if(lua_isnil(&l, -1)) {
+            lua_pop(&l, 1);
+            lua_newtable(&l);
+            lua_pushcfunction(&l, &gc);
+            lua_setfield(&l, -2, "__gc");
+            lua_pushvalue(&l, -1);
+            lua_rawsetp(&l, LUA_REGISTRYINDEX, api::detail::_type_key<tuple_type>());
+        }
+        lua_setmetatable(&l, -2);
+        lua_pushcclosure(&l, &wrapper, 1 + detail::_push_binding_stats(l, name));
+    }
+
+    static inline int wrapper(lua_State* l) {
+        return detail::_protect<&invoke>(l);
+    }
+
+private:
+    static inline int invoke(lua_State* l) {
+        detail::_call_timer timer(l, 2);
+        tuple_type& fs = *static_cast<tuple_type*>(lua_touserdata(l, lua_upvalueindex(1)));
+        timer.argsDone();
+        int n = detail::_functor_dispatch<0, tuple_type>::call(l, fs, lua_gettop(l));
+        timer.bodyDone();
+        timer.done();
+        return n;
+    }
+
+    static int gc(lua_State* l) {
+        static_cast<tuple_type*>(lua_touserdata(l, 1))->~tuple_type();
+        return 0;
+    }
+};
+
+} // namespace glua
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "api.hpp"
+#include "hooks.hpp"
+
+/**
+ * profiler.hpp
+ * Contains glua::profiler, a sampling profiler for lua code which
+ * aggregates call stacks in the folded format understood by flamegraph
+ * tools (one "outer;...;inner count" line per distinct stack).
+ *
+ * Sampling uses a count hook (see hooks.hpp), so nothing is installed (and nothing
+ * is paid) while the profiler is stopped. Frames are written as
+ * function:source:line, where line is the line the function was
+ * defined on, so all samples inside one function merge into one frame.
+ */
+
+namespace glua {
+
+class profiler {
+public:
+    explicit profiler(lua_State& l) : l(l), total(0), hookId(0) {}
+
+    profiler(const profiler&) = delete;
+    profiler& operator=(const profiler&) = delete;
+
+    ~profiler() {
+        stop();
+    }
+
+    /**
+     * Start sampling the call stack once every interval
+     * lua instructions.
+     */
+    inline void start(int interval = 10000) {
+        stop();
+        hookId = detail::_hooks::add(l, &sample, this, interval);
+    }
+
+    /**
+     * Stop sampling. Collected samples are kept.
+     */
+    inline void stop() {
+        if(hookId == 0) return;
+        detail::_hooks::remove(l, hookId);
+        hookId = 0;
+    }
+
+    inline bool running() const { return hookId != 0; }
+
+    /**
+     * Discard all collected samples.
+     */
+    inline void clear() {
+        stacks.clear();
+        total = 0;
+    }
+
+    /**
+     * Total number of samples taken.
+     */
+    inline size_t samples() const { return total; }
+
+    /**
+     * Write the samples in folded-stack format.
+     */
+    inline void write(std::ostream& out) const {
+        for(const auto& s : stacks) out << s.first << ' ' << s.second << '\n';
+    }
+
+    /**
+     * Get the samples in folded-stack format.
+     */
+    inline std::string folded() const {
+        std::ostringstream out;
+        write(out);
+        return out.str();
+    }
+
+private:
+    static constexpr int max_depth = 128;
+
+    /**
+     * Append the frames of the current stack, outermost first,
+     * to key.
+     */
+    static inline void fold(lua_State* l, std::string& key, int level) {
+        lua_Debug ar;
+        if(level >= max_depth || !lua_getstack(l, level, &ar)) return;
+        fold(l, key, level + 1);
+        lua_getinfo(l, "Sn", &ar);
+        if(!key.empty()) key.push_back(';');
+        if(ar.name != nullptr)         key += ar.name;
+        else if(*ar.what == 'm')       key += "main";
+        else                           key += '?';
+        key.push_back(':');
+        key += ar.short_src;
+        key.push_back(':');
+        key += std::to_string(ar.linedefined);
+    }
+
+    static bool sample(lua_State* l, void* ctx) {
+        profiler* self = static_cast<profiler*>(ctx);
+        self->scratch.clear();
+        fold(l, self->scratch, 0);
+        ++self->stacks[self->scratch];
+        ++self->total;
+        return false;
+    }
+
+    lua_State& l;
+    std::unordered_map<std::string, size_t> stacks;
+    std::string scratch;
+    size_t total;
+    int hookId;
+};
+
+} // namespace glua
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "api.hpp"
+
+/**
+ * range.hpp
+ * Contains glua::pairs_range and glua::ipairs_range, which iterate a
+ * lua table from C++ with range-for:
+ *
+ *   for(auto kv : s["prices"].pairs<std::string, double>()) ...
+ *   for(auto iv : s["list"].ipairs<int>()) ...
+ *
+ * Iteration is raw (no __pairs or __index) and works on the stack
+ * in place: the table, the current key and the current value sit in
+ * fixed slots above the stack top at the start of the loop, and each
+ * element is converted straight from its slot, so a step costs one
+ * lua_next or lua_rawgeti and no allocation (for std::string_view or
+ * const char* keys and values). A string_view or const char* is only
+ * valid until the next step.
+ *
+ * ipairs iterates 1..n, where n is the raw length when the loop
+ * starts, and converts nil values like any other.
+ *
+ * The loop body must leave the stack as it found it. Using a
+ * glua::global inside it is fine, since a global only pops what was
+ * pushed after it was created. Elements which don't convert to the
+ * requested types throw std::runtime_error. While no loop runs the
+ * range keeps the table in the registry: the global it came from
+ * pops the table again at the end of the range expression, before
+ * the loop starts.
+ */
+
+namespace glua {
+namespace detail {
+
+template<typename T>
+struct _is_string_type : std::integral_constant<bool,
+    std::is_same<T, std::string>::value || std::is_same<T, const char*>::value
+#ifdef GLUA_STRING_VIEW
+    || std::is_same<T, std::string_view>::value
+#endif
+> {};
+
+/**
+ * Convert the key at index. String keys must be strings: converting
+ * a number key in place would break lua_next.
+ */
+template<typename K>
+inline K _table_key(lua_State& l, int index) {
+    if(_is_string_type<K>::value && lua_type(&l, index) != LUA_TSTRING) {
+        api::detail::_arg_error(l, index, "string key");
+    }
+    return api::detail::_arg_impl<K>::get(l, index);
+}
+
+/**
+ * Owns a table while it isn't being iterated, and the stack slots
+ * above base while it is.
+ */
+class _table_range {
+public:
+    _table_range(_table_range&& r) : l(r.l), key(r.key), base(r.base) {
+        r.key = LUA_NOREF;
+        r.base = -1;
+    }
+
+    _table_range(const _table_range&) = delete;
+    _table_range& operator=(const _table_range&) = delete;
+
+    ~_table_range() {
+        if(base >= 0 && lua_gettop(&l) > base) lua_settop(&l, base);
+        luaL_unref(&l, LUA_REGISTRYINDEX, key);
+    }
+
+protected:
+    /**
+     * Take the table on top of the stack.
+     */
+    explicit _table_range(lua_State& l) : l(l), key(LUA_NOREF), base(-1) {
+        if(lua_type(&l, -1) != LUA_TTABLE) {
+            std::string type = luaL_typename(&l, -1);
+            lua_pop(&l, 1);
+            throw std::runtime_error("Error: attempt to iterate a " + type + " value");
+        }
+        key = luaL_ref(&l, LUA_REGISTRYINDEX);
+    }
+
+    /**
+     * Push the table for a loop; returns its index.
+     */
+    inline int start() {
+        if(base >= 0 && lua_gettop(&l) > base) lua_settop(&l, base);
+        base = lua_gettop(&l);
+        lua_rawgeti(&l, LUA_REGISTRYINDEX, key);
+        return base + 1;
+    }
+
+    lua_State& l;
+    int key;
+    int base;
+};
+
+} // namespace detail
+
+template<typename K, typename V>
+class pairs_range : public detail::_table_range {
+public:
+    class iterator {
+    public:
+        inline std::pair<K, V> operator*() const {
+            return std::pair<K, V>(detail::_table_key<K>(*l, table + 1),
+                                   api::detail::_arg_impl<V>::get(*l, table + 2));
+        }
+
+        inline iterator& operator++() {
+            lua_settop(l, table + 1);
+            if(!lua_next(l, table)) l = nullptr;
+            return *this;
+        }
+
+        inline bool operator!=(const iterator& o) const { return l != o.l; }
+        inline bool operator==(const iterator& o) const { return l == o.l; }
+
+    private:
+        friend class pairs_range;
+
+        iterator() : l(nullptr), table(0) {}
+        iterator(lua_State& l, int table) : l(&l), table(table) {
+            lua_pushnil(this->l);
+            if(!lua_next(this->l, table)) this->l = nullptr;
+        }
+
+        lua_State* l;
+        int table;
+    };
+
+    /**
+     * Take the table on top of the stack. Throws if it isn't one.
+     */
+    explicit pairs_range(lua_State& l) : detail::_table_range(l) {}
+    pairs_range(pairs_range&& r) : detail::_table_range(std::move(r)) {}
+
+    inline iterator begin() { return iterator(l, start()); }
+    inline iterator end() { return iterator(); }
+};
+
+template<typename V>
+class ipairs_range : public detail::_table_range {
+public:
+    class iterator {
+    public:
+        inline std::pair<lua_Integer, V> operator*() const {
+            return std::pair<lua_Integer, V>(i, api::detail::_arg_impl<V>::get(*l, table + 1));
+        }
+
+        inline iterator& operator++() {
+            lua_settop(l, table);
+            fetch(i + 1);
+            return *this;
+        }
+
+        inline bool operator!=(const iterator& o) const { return l != o.l; }
+        inline bool operator==(const iterator& o) const { return l == o.l; }
+
+    private:
+        friend class ipairs_range;
+
+        iterator() : l(nullptr), table(0), i(0), n(0) {}
+        iterator(lua_State& l, int table)
+        : l(&l), table(table), i(0), n(static_cast<lua_Integer>(lua_rawlen(&l, table)))
+        {
+            fetch(1);
+        }
+
+        inline void fetch(lua_Integer next) {
+            i = next;
+            if(i > n) {
+                l = nullptr;
+                return;
+            }
+            lua_rawgeti(l, table, i);
+        }
+
+        lua_State* l;
+        int table;
+        lua_Integer i;
+        lua_Integer n;
+    };
+
+    /**
+     * Take the table on top of the stack. Throws if it isn't one.
+     */
+    explicit ipairs_range(lua_State& l) : detail::_table_range(l) {}
+    ipairs_range(ipairs_range&& r) : detail::_table_range(std::move(r)) {}
+
+    inline iterator begin() { return iterator(l, start()); }
+    inline iterator end() { return iterator(); }
+};
+
+} // namespace glua
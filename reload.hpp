@@ -0,0 +1,561 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "api.hpp"
+#include "cfunction.hpp"
+#include "util/hash.hpp"
+
+/**
+ * reload.hpp
+ * Hot reload of lua modules in a live state. A glua::reloader adds a
+ * searcher which loads modules from package.path itself, remembering
+ * the file, its modification time and a hash of its contents, and
+ * wraps require to record which module required which while loading.
+ *
+ * reloader::poll stats the tracked files and recompiles only modules
+ * whose contents changed; files which were merely touched are skipped
+ * by hash. Each changed module is run again, dependencies first, and
+ * the table it returns is merged into the table already in
+ * package.loaded, so the module keeps its identity:
+ *
+ *  - functions replace the old functions of the same key
+ *  - keys the old table lacks are added
+ *  - nested tables are merged the same way
+ *  - other existing values are kept, so live state survives
+ *
+ * Afterwards every reference to a replaced function is re-pointed:
+ * values in the registry (which holds all glua::ref and
+ * glua::function handles) and in the globals, and upvalues of the
+ * functions reachable from the reloaded modules and the modules which
+ * required them, directly or not. Upvalues of the new functions
+ * which refer to the fresh module table are pointed at the live one.
+ * References held anywhere else, e.g. in tables created at run time,
+ * keep the old function.
+ *
+ * All changed modules are compiled before any of them runs, so a
+ * syntax error leaves the state untouched. A module which raises an
+ * error while running is left as it was, and is tried again by the
+ * next poll.
+ */
+
+namespace glua {
+namespace detail {
+
+/**
+ * Identifies the contents of a file without reading it.
+ */
+struct _file_stamp {
+    int64_t sec;
+    long nsec;
+    int64_t size;
+
+    inline bool operator==(const _file_stamp& o) const {
+        return sec == o.sec && nsec == o.nsec && size == o.size;
+    }
+};
+
+inline bool _stat_file(const std::string& path, _file_stamp& stamp) {
+    struct stat st;
+    if(::stat(path.c_str(), &st) != 0) return false;
+    stamp.sec = static_cast<int64_t>(st.st_mtime);
+#if defined(__APPLE__)
+    stamp.nsec = st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+    stamp.nsec = st.st_mtim.tv_nsec;
+#else
+    stamp.nsec = 0;
+#endif
+    stamp.size = static_cast<int64_t>(st.st_size);
+    return true;
+}
+
+inline bool _read_file(const std::string& path, std::string& out) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) return false;
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    out = contents.str();
+    return true;
+}
+
+struct _reload_module {
+    std::string path;               // empty if not loaded by the reloader
+    _file_stamp stamp = {0, 0, 0};
+    uint32_t hash = 0;
+    std::string pending;            // changed source, until it is reloaded
+    std::set<std::string> deps;
+};
+
+/**
+ * The module graph, owned by a userdata in the state so the searcher
+ * and require wrapper stay valid after the reloader is destroyed.
+ */
+struct _reload_graph {
+    std::map<std::string, _reload_module> modules;
+    std::vector<std::string> loading;
+};
+
+/**
+ * Merge the table fresh into the table old as described above,
+ * recording replaced values in map. seen holds the tables already
+ * merged.
+ */
+inline void _reload_merge(lua_State* l, int old, int fresh, int map, int seen) {
+    lua_pushvalue(l, old);
+    lua_rawget(l, seen);
+    bool done = !lua_isnil(l, -1);
+    lua_pop(l, 1);
+    if(done) return;
+    lua_pushvalue(l, old);
+    lua_pushboolean(l, 1);
+    lua_rawset(l, seen);
+
+    // Upvalues of the new functions should see the live table
+    lua_pushvalue(l, fresh);
+    lua_pushvalue(l, old);
+    lua_rawset(l, map);
+
+    if(!lua_checkstack(l, 8)) throw std::runtime_error("Error: module tables nested too deeply to reload");
+    lua_pushnil(l);
+    while(lua_next(l, fresh)) {
+        int value = lua_gettop(l);
+        lua_pushvalue(l, value - 1);
+        lua_rawget(l, old);
+        int current = value + 1;
+        int vt = lua_type(l, value);
+        int ct = lua_type(l, current);
+        if(ct == LUA_TNIL || (vt == LUA_TFUNCTION && ct == LUA_TFUNCTION)) {
+            if(ct == LUA_TFUNCTION && !lua_rawequal(l, current, value)) {
+                lua_pushvalue(l, current);
+                lua_pushvalue(l, value);
+                lua_rawset(l, map);
+            }
+            lua_pushvalue(l, value - 1);
+            lua_pushvalue(l, value);
+            lua_rawset(l, old);
+        } else if(vt == LUA_TTABLE && ct == LUA_TTABLE && !lua_rawequal(l, current, value)) {
+            _reload_merge(l, current, value, map, seen);
+        }
+        lua_pop(l, 2);
+    }
+}
+
+/**
+ * Replace the values found in map among the upvalues of the function
+ * at index, and of the functions it closes over.
+ */
+inline void _reload_upvalues(lua_State* l, int fn, int map, int seen) {
+    lua_pushvalue(l, fn);
+    lua_rawget(l, seen);
+    bool done = !lua_isnil(l, -1);
+    lua_pop(l, 1);
+    if(done) return;
+    lua_pushvalue(l, fn);
+    lua_pushboolean(l, 1);
+    lua_rawset(l, seen);
+
+    if(!lua_checkstack(l, 8)) throw std::runtime_error("Error: functions nested too deeply to reload");
+    for(int i = 1; lua_getupvalue(l, fn, i) != nullptr; ++i) {
+        lua_pushvalue(l, -1);
+        lua_rawget(l, map);
+        if(!lua_isnil(l, -1)) {
+            lua_setupvalue(l, fn, i);
+        } else {
+            lua_pop(l, 1);
+            if(lua_type(l, -1) == LUA_TFUNCTION) _reload_upvalues(l, lua_gettop(l), map, seen);
+        }
+        lua_pop(l, 1);
+    }
+}
+
+/**
+ * Replace the values found in map in the table at index. If deep,
+ * also in the tables it holds and in the upvalues of the functions
+ * it holds.
+ */
+inline void _reload_repoint(lua_State* l, int t, int map, int seen, bool deep) {
+    if(deep) {
+        lua_pushvalue(l, t);
+        lua_rawget(l, seen);
+        bool done = !lua_isnil(l, -1);
+        lua_pop(l, 1);
+        if(done) return;
+        lua_pushvalue(l, t);
+        lua_pushboolean(l, 1);
+        lua_rawset(l, seen);
+    }
+
+    if(!lua_checkstack(l, 8)) throw std::runtime_error("Error: module tables nested too deeply to reload");
+    lua_pushnil(l);
+    while(lua_next(l, t)) {
+        lua_pushvalue(l, -1);
+        lua_rawget(l, map);
+        if(!lua_isnil(l, -1)) {
+            lua_pushvalue(l, -3);
+            lua_insert(l, -2);
+            lua_rawset(l, t);
+        } else {
+            lua_pop(l, 1);
+            if(deep && lua_type(l, -1) == LUA_TTABLE)    _reload_repoint(l, lua_gettop(l), map, seen, true);
+            if(deep && lua_type(l, -1) == LUA_TFUNCTION) _reload_upvalues(l, lua_gettop(l), map, seen);
+        }
+        lua_pop(l, 1);
+    }
+}
+
+} // namespace detail
+
+class reloader {
+public:
+    static constexpr const char* metatable = "glua.reloader";
+
+    /**
+     * Start tracking the modules l loads from now on. Requires the
+     * package library; create the reloader before requiring the
+     * modules to reload, and before taking a sandbox environment.
+     */
+    explicit reloader(lua_State& l) : l(l), graph(std::make_shared<detail::_reload_graph>()) {
+        lua_getglobal(&l, "package");
+        if(lua_type(&l, -1) == LUA_TTABLE) lua_getfield(&l, -1, detail::_searchers_field);
+        else                               lua_pushnil(&l);
+        lua_getglobal(&l, "require");
+        if(lua_type(&l, -2) != LUA_TTABLE || lua_type(&l, -1) != LUA_TFUNCTION) {
+            lua_pop(&l, 3);
+            throw std::runtime_error("Error: glua reloading requires the package library");
+        }
+        int searchers = lua_gettop(&l) - 1;
+
+        using holder = std::shared_ptr<detail::_reload_graph>;
+        holder* h = static_cast<holder*>(lua_newuserdata(&l, sizeof(holder)));
+        if(h == nullptr) throw std::runtime_error("Error: lua_newuserdata returned null pointer");
+        new (h) holder(graph);
+        if(luaL_newmetatable(&l, metatable)) {
+            lua_pushcfunction(&l, &l_gc);
+            lua_setfield(&l, -2, "__gc");
+        }
+        lua_setmetatable(&l, -2);
+
+        // require(name) records the edge, then calls the original
+        lua_pushvalue(&l, -1);
+        lua_pushvalue(&l, -3);
+        lua_pushcclosure(&l, &l_require, 2);
+        lua_setglobal(&l, "require");
+
+        // The searcher goes after the preload searcher, as a bundle's
+        lua_pushcclosure(&l, &l_search, 1);
+        int n = static_cast<int>(lua_rawlen(&l, searchers));
+        for(int i = n; i >= 2; --i) {
+            lua_rawgeti(&l, searchers, i);
+            lua_rawseti(&l, searchers, i + 1);
+        }
+        lua_rawseti(&l, searchers, n >= 1 ? 2 : 1);
+        lua_pop(&l, 3);
+    }
+
+    // No copying
+    reloader(reloader&) = delete;
+    reloader& operator=(reloader&) = delete;
+
+    /**
+     * Reload every tracked module whose file changed since it was
+     * loaded. Returns the number of modules reloaded. Throws a
+     * glua::error if a changed module doesn't compile or raises an
+     * error.
+     */
+    inline size_t poll() {
+        std::vector<std::string> changed;
+        for(auto& m : graph->modules) {
+            if(stale(m.second)) changed.push_back(m.first);
+        }
+        return reload(changed);
+    }
+
+    /**
+     * Reload module name if its file changed. Returns false if it
+     * didn't, or if the module isn't tracked.
+     */
+    inline bool reload(const std::string& name) {
+        auto it = graph->modules.find(name);
+        if(it == graph->modules.end() || !stale(it->second)) return false;
+        return reload(std::vector<std::string>{name}) != 0;
+    }
+
+    /**
+     * The modules required by module name while it was loading.
+     */
+    inline std::vector<std::string> dependencies(const std::string& name) const {
+        auto it = graph->modules.find(name);
+        if(it == graph->modules.end()) return {};
+        return std::vector<std::string>(it->second.deps.begin(), it->second.deps.end());
+    }
+
+    /**
+     * The modules which required module name, directly or not.
+     */
+    inline std::vector<std::string> dependents(const std::string& name) const {
+        std::set<std::string> found;
+        std::vector<std::string> todo{name};
+        while(!todo.empty()) {
+            std::string next = std::move(todo.back());
+            todo.pop_back();
+            for(const auto& m : graph->modules) {
+                if(m.second.deps.count(next) && found.insert(m.first).second) todo.push_back(m.first);
+            }
+        }
+        found.erase(name);
+        return std::vector<std::string>(found.begin(), found.end());
+    }
+
+private:
+    /**
+     * True if the file of m changed; its new source is then pending.
+     * Files which were touched but have the same contents only get
+     * their stamp updated.
+     */
+    inline bool stale(detail::_reload_module& m) {
+        if(m.path.empty()) return false;
+        detail::_file_stamp stamp;
+        // A file which disappeared keeps its module as it is
+        if(!detail::_stat_file(m.path, stamp)) return false;
+        if(stamp == m.stamp && m.pending.empty()) return false;
+        std::string source;
+        if(!detail::_read_file(m.path, source)) return false;
+        m.stamp = stamp;
+        if(detail::_fnv1a(source.data(), source.size()) == m.hash) {
+            m.pending.clear();
+            return false;
+        }
+        m.pending = std::move(source);
+        return true;
+    }
+
+    /**
+     * Visit name and the changed modules it requires, appending them
+     * to order dependencies first.
+     */
+    inline void sort(const std::string& name, const std::set<std::string>& changed,
+                     std::set<std::string>& visited, std::vector<std::string>& order) const
+    {
+        if(!visited.insert(name).second) return;
+        auto it = graph->modules.find(name);
+        if(it == graph->modules.end()) return;
+        for(const auto& dep : it->second.deps) sort(dep, changed, visited, order);
+        if(changed.count(name)) order.push_back(name);
+    }
+
+    inline size_t reload(const std::vector<std::string>& names) {
+        if(names.empty()) return 0;
+        std::set<std::string> changed(names.begin(), names.end());
+        std::set<std::string> visited;
+        std::vector<std::string> order;
+        for(const auto& name : names) sort(name, changed, visited, order);
+
+        int base = lua_gettop(&l);
+        // Compile everything first, so a syntax error changes nothing
+        for(const auto& name : order) {
+            detail::_reload_module& m = graph->modules[name];
+            std::string chunkname = "@" + m.path;
+            int status = luaL_loadbuffer(&l, m.pending.data(), m.pending.size(), chunkname.c_str());
+            if(status != LUA_OK) {
+                lua_replace(&l, base + 1);
+                lua_settop(&l, base + 1);
+                ::glua::detail::_throw_error(l, status);
+            }
+        }
+
+        lua_getglobal(&l, "package");
+        lua_getfield(&l, -1, "loaded");
+        int loaded = lua_gettop(&l);
+        lua_newtable(&l);
+        int map = loaded + 1;
+        lua_newtable(&l);
+        int seen = loaded + 2;
+
+        size_t done = 0;
+        try {
+            for(size_t i = 0; i < order.size(); ++i) {
+                run(order[i], base + 1 + static_cast<int>(i), loaded, map, seen);
+                ++done;
+            }
+        } catch(...) {
+            graph->loading.clear();
+            if(done != 0) repoint(order, loaded, map);
+            lua_settop(&l, base);
+            throw;
+        }
+        repoint(order, loaded, map);
+        lua_settop(&l, base);
+        return done;
+    }
+
+    /**
+     * Run the compiled chunk of module name at index and merge the
+     * result into package.loaded.
+     */
+    inline void run(const std::string& name, int chunk, int loaded, int map, int seen) {
+        detail::_reload_module& m = graph->modules[name];
+        lua_getfield(&l, loaded, name.c_str());
+        int old = lua_gettop(&l);
+
+        std::set<std::string> deps = std::move(m.deps);
+        m.deps.clear();
+        graph->loading.push_back(name);
+        lua_pushvalue(&l, chunk);
+        lua_pushstring(&l, name.c_str());
+        lua_pushstring(&l, m.path.c_str());
+        try {
+            api::call(l, 2, 1);
+        } catch(...) {
+            graph->loading.pop_back();
+            m.deps = std::move(deps);
+            throw;
+        }
+        graph->loading.pop_back();
+        // A module may store itself in package.loaded instead of returning
+        if(lua_isnil(&l, -1)) {
+            lua_pop(&l, 1);
+            lua_getfield(&l, loaded, name.c_str());
+            if(lua_isnil(&l, -1) || lua_rawequal(&l, -1, old)) {
+                lua_pop(&l, 1);
+                lua_pushboolean(&l, 1);
+            }
+        }
+        int fresh = old + 1;
+
+        if(lua_type(&l, old) == LUA_TTABLE && lua_type(&l, fresh) == LUA_TTABLE) {
+            if(!lua_rawequal(&l, old, fresh)) detail::_reload_merge(&l, old, fresh, map, seen);
+            lua_pushvalue(&l, old);
+        } else {
+            if(lua_type(&l, old) == LUA_TFUNCTION && lua_type(&l, fresh) == LUA_TFUNCTION) {
+                lua_pushvalue(&l, old);
+                lua_pushvalue(&l, fresh);
+                lua_rawset(&l, map);
+            }
+            lua_pushvalue(&l, fresh);
+        }
+        lua_setfield(&l, loaded, name.c_str());
+        lua_settop(&l, old - 1);
+
+        m.hash = detail::_fnv1a(m.pending.data(), m.pending.size());
+        m.pending.clear();
+    }
+
+    /**
+     * Re-point references to the values replaced by reloading the
+     * modules in order.
+     */
+    inline void repoint(const std::vector<std::string>& order, int loaded, int map) {
+        lua_newtable(&l);
+        int seen = lua_gettop(&l);
+        detail::_reload_repoint(&l, LUA_REGISTRYINDEX, map, seen, false);
+        detail::_push_globals(&l);
+        detail::_reload_repoint(&l, lua_gettop(&l), map, seen, false);
+        lua_pop(&l, 1);
+
+        std::set<std::string> affected(order.begin(), order.end());
+        for(const auto& name : order) {
+            for(auto& d : dependents(name)) affected.insert(std::move(d));
+        }
+        for(const auto& name : affected) {
+            lua_getfield(&l, loaded, name.c_str());
+            int t = lua_gettop(&l);
+            if(lua_type(&l, t) == LUA_TTABLE)         detail::_reload_repoint(&l, t, map, seen, true);
+            else if(lua_type(&l, t) == LUA_TFUNCTION) detail::_reload_upvalues(&l, t, map, seen);
+            lua_pop(&l, 1);
+        }
+        lua_pop(&l, 1);
+    }
+
+    static inline detail::_reload_graph& graphOf(lua_State* l) {
+        return **static_cast<std::shared_ptr<detail::_reload_graph>*>(lua_touserdata(l, lua_upvalueindex(1)));
+    }
+
+    /**
+     * The searcher: finds the module named by argument 1 on
+     * package.path, loads it and starts tracking its file.
+     */
+    static int l_search(lua_State* l) {
+        return detail::_protect<&search>(l);
+    }
+
+    static inline int search(lua_State* l) {
+        luaL_checkstring(l, 1);
+        lua_settop(l, 1);
+        lua_getglobal(l, "package");
+        lua_getfield(l, 2, "searchpath");
+        if(lua_type(l, 3) != LUA_TFUNCTION) {
+            lua_pushliteral(l, "\n\tno package.searchpath to reload modules with");
+            return 1;
+        }
+        lua_pushvalue(l, 1);
+        lua_getfield(l, 2, "path");
+        lua_call(l, 2, 2);
+        if(lua_isnil(l, 3)) return 1;
+
+        std::string name = lua_tostring(l, 1);
+        std::string path = lua_tostring(l, 3);
+        detail::_reload_module m;
+        if(!detail::_stat_file(path, m.stamp) || !detail::_read_file(path, m.pending)) {
+            throw std::runtime_error("error loading module '" + name + "': couldn't read " + path);
+        }
+        std::string chunkname = "@" + path;
+        if(luaL_loadbuffer(l, m.pending.data(), m.pending.size(), chunkname.c_str()) != LUA_OK) {
+            throw std::runtime_error("error loading module '" + name + "' from file '" + path + "':\n\t" +
+                                     lua_tostring(l, -1));
+        }
+        m.hash = detail::_fnv1a(m.pending.data(), m.pending.size());
+        m.pending.clear();
+        m.path = path;
+        detail::_reload_module& tracked = graphOf(l).modules[name];
+        m.deps = std::move(tracked.deps);
+        tracked = std::move(m);
+        lua_pushvalue(l, 3);
+        return 2;
+    }
+
+    /**
+     * Wraps require (upvalue 2), recording that the module being
+     * loaded requires argument 1.
+     */
+    static int l_require(lua_State* l) {
+        detail::_protect<&enter>(l);
+        lua_settop(l, 1);
+        lua_pushvalue(l, lua_upvalueindex(2));
+        lua_insert(l, 1);
+        int status = lua_pcall(l, 1, LUA_MULTRET, 0);
+        graphOf(l).loading.pop_back();
+        if(status != LUA_OK) return lua_error(l);
+        return lua_gettop(l);
+    }
+
+    static inline int enter(lua_State* l) {
+        std::string name = luaL_checkstring(l, 1);
+        detail::_reload_graph& g = graphOf(l);
+        if(!g.loading.empty()) g.modules[g.loading.back()].deps.insert(name);
+        g.loading.push_back(name);
+        return 0;
+    }
+
+    static int l_gc(lua_State* l) {
+        using holder = std::shared_ptr<detail::_reload_graph>;
+        static_cast<holder*>(lua_touserdata(l, 1))->~holder();
+        return 0;
+    }
+
+    lua_State& l;
+    std::shared_ptr<detail::_reload_graph> graph;
+};
+
+} // namespace glua
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <string>
+
+#include "api.hpp"
+#include "libs.hpp"
+
+/**
+ * sandbox.hpp
+ * Many isolated sets of globals in one lua state. A glua::environment
+ * is a snapshot of the state's globals, shared by all sandboxes made
+ * from it; library tables in it are wrapped in read-only proxies so
+ * that one tenant can't change string or table for the others (pairs
+ * and # see through the proxies, except under LuaJIT). Libraries
+ * which libs.hpp opens lazily are opened on the first read from any
+ * sandbox. Each glua::sandbox is a single table used as the _ENV of
+ * the chunks it runs: reads fall through to the environment, writes
+ * stay in the sandbox. Creating, resetting and discarding a sandbox
+ * costs one table, against a few hundred KB for a separate state.
+ *
+ * A glua::script is compiled once and can be run in any sandbox of
+ * the same state, so tenants running the same code share its
+ * bytecode. Functions created while running a chunk keep the
+ * sandbox it ran in.
+ *
+ * Sandboxes separate globals; they are not a security boundary.
+ * Functions such as load, rawset and the debug library reach past
+ * them unless left out of the environment.
+ */
+
+namespace glua {
+namespace detail {
+
+inline int _read_only_error(lua_State* l) {
+    return luaL_error(l, "attempt to modify a read-only table");
+}
+
+#ifndef GLUA_LUAJIT
+/**
+ * __pairs and __len of read-only proxies, forwarded to the table
+ * behind the proxy (its __index).
+ */
+inline int _read_only_next(lua_State* l) {
+    lua_settop(l, 2);
+    if(lua_next(l, 1)) return 2;
+    lua_pushnil(l);
+    return 1;
+}
+
+inline int _read_only_pairs(lua_State* l) {
+    lua_pushcfunction(l, &_read_only_next);
+    luaL_getmetafield(l, 1, "__index");
+    lua_pushnil(l);
+    return 3;
+}
+
+inline int _read_only_len(lua_State* l) {
+    luaL_getmetafield(l, 1, "__index");
+    lua_len(l, -1);
+    return 1;
+}
+#endif
+
+/**
+ * Push a read-only proxy of the table at index.
+ */
+inline void _push_read_only(lua_State& l, int index) {
+    index = lua_absindex(&l, index);
+    lua_newtable(&l);
+    lua_createtable(&l, 0, 5);
+    lua_pushvalue(&l, index);
+    lua_setfield(&l, -2, "__index");
+    lua_pushcfunction(&l, &_read_only_error);
+    lua_setfield(&l, -2, "__newindex");
+#ifndef GLUA_LUAJIT
+    lua_pushcfunction(&l, &_read_only_pairs);
+    lua_setfield(&l, -2, "__pairs");
+    lua_pushcfunction(&l, &_read_only_len);
+    lua_setfield(&l, -2, "__len");
+#endif
+    lua_pushboolean(&l, 0);
+    lua_setfield(&l, -2, "__metatable");
+    lua_setmetatable(&l, -2);
+}
+
+/**
+ * __index of an environment taken while libraries were still to be
+ * opened on first use (see libs.hpp). Upvalue 1 holds the names of
+ * those libraries; the first read of one opens it through _G and
+ * stores its proxy in the environment.
+ */
+inline int _lazy_env_index(lua_State* l) {
+    lua_pushvalue(l, 2);
+    lua_rawget(l, lua_upvalueindex(1));
+    if(lua_isnil(l, -1)) return 0;
+    _push_globals(l);
+    lua_pushvalue(l, 2);
+    lua_gettable(l, -2);
+    if(lua_type(l, -1) == LUA_TTABLE) _push_read_only(*l, -1);
+    lua_pushvalue(l, 2);
+    lua_pushvalue(l, -2);
+    lua_rawset(l, 1);
+    return 1;
+}
+
+} // namespace detail
+
+class environment {
+public:
+    /**
+     * Snapshot the current globals of l. Later changes to the globals
+     * are not seen by sandboxes, except inside library tables, which
+     * are shared.
+     */
+    explicit environment(lua_State& l) : l(l) {
+        lua_newtable(&l);
+        int base = lua_gettop(&l);
+        ::glua::detail::_push_globals(&l);
+        int globals = base + 1;
+        lua_pushnil(&l);
+        while(lua_next(&l, globals)) {
+            // Each sandbox has its own _G
+            if(lua_rawequal(&l, -1, globals)) {
+                lua_pop(&l, 1);
+                continue;
+            }
+            if(lua_type(&l, -1) == LUA_TTABLE) {
+                ::glua::detail::_push_read_only(l, -1);
+                lua_remove(&l, -2);
+            }
+            lua_pushvalue(&l, -2);
+            lua_insert(&l, -2);
+            lua_rawset(&l, base);
+        }
+
+        // Libraries not opened yet are opened when a sandbox first reads them
+        if(lua_getmetatable(&l, globals)) {
+            lua_getfield(&l, -1, "__index");
+            if(lua_tocfunction(&l, -1) == &::glua::detail::_lazy_lib_index) {
+                lua_newtable(&l);
+                lua_getupvalue(&l, -2, 1);
+                lua_pushnil(&l);
+                while(lua_next(&l, -2)) {
+                    lua_pop(&l, 1);
+                    lua_pushvalue(&l, -1);
+                    lua_pushboolean(&l, 1);
+                    lua_rawset(&l, -5);
+                }
+                lua_pop(&l, 1);
+                lua_pushcclosure(&l, &::glua::detail::_lazy_env_index, 1);
+                lua_createtable(&l, 0, 1);
+                lua_insert(&l, -2);
+                lua_setfield(&l, -2, "__index");
+                lua_setmetatable(&l, base);
+            }
+            lua_settop(&l, globals);
+        }
+        lua_pop(&l, 1);
+
+        // The metatable shared by every sandbox
+        lua_createtable(&l, 0, 2);
+        lua_insert(&l, base);
+        lua_setfield(&l, base, "__index");
+        lua_pushboolean(&l, 0);
+        lua_setfield(&l, -2, "__metatable");
+        meta = api::ref(l);
+    }
+
+    environment(const environment&) = delete;
+    environment& operator=(const environment&) = delete;
+
+    ~environment() {
+        api::unref(l, meta);
+    }
+
+    inline lua_State& state() const { return l; }
+
+private:
+    friend class sandbox;
+
+    lua_State& l;
+    int meta;
+};
+
+/**
+ * A chunk compiled once to run in any sandbox.
+ */
+class script {
+public:
+    /**
+     * Compile chunk. Throws a glua::syntax_error if it doesn't compile.
+     */
+    script(lua_State& l, const std::string& chunk, const char* name = "=script") : l(l) {
+#ifdef GLUA_LUAJIT
+        int status = luaL_loadbuffer(&l, chunk.data(), chunk.size(), name);
+        if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+#else
+        // Compile the chunk as the body of a function taking _ENV as
+        // its first parameter, so each run gets its own _ENV while the
+        // prototype is shared. The prefix keeps line numbers intact.
+        // The chunk is first compiled on its own: one which compiles
+        // is a complete block, so it can't close the function early
+        // and run code outside of it.
+        int status = luaL_loadbuffer(&l, chunk.data(), chunk.size(), name);
+        if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+        lua_pop(&l, 1);
+        std::string source = "return function(_ENV, ...) " + chunk + "\nend";
+        status = luaL_loadbuffer(&l, source.data(), source.size(), name);
+        if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+        api::call(l, 0, 1);
+#endif
+        fn = api::ref(l);
+    }
+
+    script(const script&) = delete;
+    script& operator=(const script&) = delete;
+
+    ~script() {
+        api::unref(l, fn);
+    }
+
+private:
+    friend class sandbox;
+
+    lua_State& l;
+    int fn;
+};
+
+class sandbox {
+public:
+    explicit sandbox(const environment& env) : l(env.l), meta(env.meta), env(LUA_NOREF) {
+        reset();
+    }
+
+    sandbox(sandbox&& s) : l(s.l), meta(s.meta), env(s.env) {
+        s.env = LUA_NOREF;
+    }
+
+    sandbox(const sandbox&) = delete;
+    sandbox& operator=(const sandbox&) = delete;
+
+    ~sandbox() {
+        api::unref(l, env);
+    }
+
+    /**
+     * Discard all globals set in the sandbox.
+     */
+    inline void reset() {
+        api::unref(l, env);
+        lua_createtable(&l, 0, 1);
+        lua_pushvalue(&l, -1);
+        lua_setfield(&l, -2, "_G");
+        api::getRef(l, meta);
+        lua_setmetatable(&l, -2);
+        env = api::ref(l);
+    }
+
+    /**
+     * Compile and run a chunk in the sandbox. Throws a glua::error
+     * if it can't be compiled or raises an error.
+     */
+    inline void run(const std::string& chunk, const char* name = "=sandbox") {
+        int status = luaL_loadbuffer(&l, chunk.data(), chunk.size(), name);
+        if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+        push();
+        ::glua::detail::_set_chunk_env(&l, -2);
+        api::call(l, 0, 0);
+    }
+
+    /**
+     * Run a precompiled script in the sandbox.
+     */
+    inline void run(const script& s) {
+        api::getRef(l, s.fn);
+#ifdef GLUA_LUAJIT
+        push();
+        lua_setfenv(&l, -2);
+        api::call(l, 0, 0);
+#else
+        push();
+        api::call(l, 1, 0);
+#endif
+    }
+
+    /**
+     * Set a global of the sandbox.
+     */
+    template<typename T>
+    inline void set(const char* name, T val) {
+        push();
+        api::push(l, val);
+        lua_setfield(&l, -2, name);
+        lua_pop(&l, 1);
+    }
+
+    /**
+     * Get a global of the sandbox, falling back to the environment.
+     */
+    template<typename T>
+    inline T get(const char* name) {
+        push();
+        lua_getfield(&l, -1, name);
+        T val = api::checkGet<T>(l);
+        lua_pop(&l, 2);
+        return val;
+    }
+
+    /**
+     * Push the sandbox's global table.
+     */
+    inline void push() {
+        api::getRef(l, env);
+    }
+
+private:
+    lua_State& l;
+    int meta;
+    int env;
+};
+
+} // namespace glua
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <type_traits>
+
 #include "api.hpp"
+#include "range.hpp"
 
 namespace glua {
 
@@ -92,6 +95,26 @@ public:
         return detail::ret(l);
     }
 
+    /**
+     * Iterate the table as (key, value) pairs converted to K and V,
+     * see range.hpp.
+     */
+    template<typename K, typename V>
+    inline pairs_range<K, V> pairs() {
+        this->push();
+        return pairs_range<K, V>(l);
+    }
+
+    /**
+     * Iterate t[1..#t] as (index, value) pairs with values converted
+     * to V, see range.hpp.
+     */
+    template<typename V>
+    inline ipairs_range<V> ipairs() {
+        this->push();
+        return ipairs_range<V>(l);
+    }
+
 protected:
     selector_base(lua_State& l) : l(l) {}
 };
@@ -109,13 +132,17 @@ public:
     template<typename T>
     inline void operator=(T val) { set(val); }
 
+    inline selector(const selector& s) : selector_base(s.l), key(s.key) {}
+
     template<typename K>
-    inline auto operator[](K&& nextKey) && -> selector<K> {
+    inline auto operator[](K&& nextKey) && -> selector<typename std::decay<K>::type> {
         this->push();
-        return selector<K>(l, std::forward<K>(nextKey));
+        return selector<typename std::decay<K>::type>(l, std::forward<K>(nextKey));
     }
 
 protected:
+    template<typename> friend class selector;
+
     inline selector(lua_State& l, Key&& key) : selector_base(l), key(key) {}
     inline selector(lua_State& l, const Key& key) : selector_base(l), key(key) {}
 
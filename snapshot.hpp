@@ -0,0 +1,703 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "api.hpp"
+
+/**
+ * snapshot.hpp
+ * Contains glua::snapshot, which serializes everything reachable from
+ * the globals of an initialized state (module tables, closures and
+ * their upvalues, metatables) into an image, and restores the image
+ * into a fresh state. Restoring loads bytecode and builds tables,
+ * without parsing or running any initialization code.
+ *
+ * What a script can't recreate, C functions and the tables and
+ * userdata set up from C++, is matched between the two states by
+ * name. snapshot::baseline, called once native setup (opening the
+ * libraries, registering functions and classes) is done and before
+ * any script runs, names every object reachable from the globals,
+ * the string keys of the registry and the string metatable by its
+ * shortest path, e.g. _G.string.format. An image can be restored
+ * into any state which went through the same native setup; the
+ * objects it names are looked up there by path. Tables named in the
+ * baseline keep their identity but get their contents from the image.
+ *
+ * Userdata created after the baseline need a hook for their type,
+ * registered with snapshot_hooks::add; any other userdata, threads
+ * and C functions which are not in the baseline make capture throw.
+ * Shared upvalues stay shared. Libraries opened lazily must be
+ * opened before the baseline, and glua::ref handles don't carry over.
+ * Under LuaJIT restored functions use the globals as environment.
+ *
+ * Images contain bytecode and are only portable between builds of
+ * the same lua version on the same architecture.
+ *
+ * Layout: "GLUASNP1" version LUA_VERSION_NUM, then the globals table
+ * as a tagged value stream, tables and functions being numbered in
+ * order of appearance so later occurrences are references.
+ */
+
+namespace glua {
+namespace detail {
+
+enum _snapshot_tag : uint8_t {
+    _snap_nil      = 0,
+    _snap_false    = 1,
+    _snap_true     = 2,
+    _snap_integer  = 3,
+    _snap_number   = 4,
+    _snap_string   = 5,
+    _snap_ref      = 6,     // id
+    _snap_base     = 7,     // path
+    _snap_table    = 8,     // {key value}... end metatable
+    _snap_base_tbl = 9,     // path {key value}... end metatable
+    _snap_function = 10,    // proto [bytecode] nups {upvalue | joined}...
+    _snap_joined   = 11,    // id upvalue
+    _snap_userdata = 12,    // type payload
+    _snap_end      = 13
+};
+
+constexpr char     _snapshot_magic[8] = {'G', 'L', 'U', 'A', 'S', 'N', 'P', '1'};
+constexpr uint32_t _snapshot_version  = 1;
+constexpr int      _snapshot_depth    = 4;
+
+inline const void* _snapshot_key() {
+    static const char key = 0;
+    return &key;
+}
+
+/**
+ * True if a before b in the order used to pick an object's name.
+ */
+inline bool _snapshot_path_less(const std::string& a, const std::string& b) {
+    return a.size() != b.size() ? a.size() < b.size() : a < b;
+}
+
+/**
+ * Append key k to path; keys which would make a path ambiguous are
+ * length-prefixed.
+ */
+inline std::string _snapshot_path(const std::string& path, char sep, const char* k, size_t klen) {
+    std::string key(k, klen);
+    if(key.empty() || key.find_first_of(".#[") != std::string::npos) {
+        key = "[" + std::to_string(klen) + ":" + key + "]";
+    }
+    return path + sep + key;
+}
+
+inline bool _snapshot_object(int type) {
+    return type == LUA_TTABLE || type == LUA_TFUNCTION || type == LUA_TUSERDATA ||
+           type == LUA_TTHREAD || type == LUA_TLIGHTUSERDATA;
+}
+
+/**
+ * Push a table mapping each object reachable from the roots to its
+ * path, see above. Objects are named level by level, each at the
+ * first level it is found on, so the names don't depend on the
+ * order of table traversal.
+ */
+inline void _snapshot_names(lua_State* l) {
+    lua_newtable(l);
+    int names = lua_gettop(l);
+    lua_newtable(l);
+    int frontier = names + 1;
+    int count = 0;
+
+    auto root = [&](const char* name) {
+        if(lua_type(l, -1) == LUA_TTABLE) {
+            lua_pushvalue(l, -1);
+            lua_pushstring(l, name);
+            lua_rawset(l, names);
+            lua_rawseti(l, frontier, ++count);
+        } else {
+            lua_pop(l, 1);
+        }
+    };
+    _push_globals(l);
+    root("_G");
+    lua_pushvalue(l, LUA_REGISTRYINDEX);
+    root("@");
+    lua_pushliteral(l, "");
+    if(lua_getmetatable(l, -1)) {
+        lua_remove(l, -2);
+        root("$");
+    } else {
+        lua_pop(l, 1);
+    }
+
+    for(int depth = 0; depth < _snapshot_depth && count != 0; ++depth) {
+        std::unordered_map<const void*, std::string> found;
+        lua_newtable(l);
+        int fresh = frontier + 1;
+
+        auto offer = [&](int value, std::string path) {
+            lua_pushvalue(l, value);
+            lua_rawget(l, names);
+            bool named = !lua_isnil(l, -1);
+            lua_pop(l, 1);
+            if(named) return;
+            const void* p = lua_type(l, value) == LUA_TLIGHTUSERDATA ? lua_touserdata(l, value) : lua_topointer(l, value);
+            auto it = found.find(p);
+            if(it == found.end()) {
+                found.emplace(p, std::move(path));
+                lua_pushvalue(l, value);
+                lua_pushboolean(l, 1);
+                lua_rawset(l, fresh);
+            } else if(_snapshot_path_less(path, it->second)) {
+                it->second = std::move(path);
+            }
+        };
+
+        for(int i = 1; i <= count; ++i) {
+            lua_rawgeti(l, frontier, i);
+            int object = lua_gettop(l);
+            lua_pushvalue(l, object);
+            lua_rawget(l, names);
+            std::string path = lua_tostring(l, -1);
+            lua_pop(l, 1);
+            if(lua_getmetatable(l, object)) {
+                offer(object + 1, path + "#");
+                lua_pop(l, 1);
+            }
+            if(lua_type(l, object) == LUA_TTABLE) {
+                lua_pushnil(l);
+                while(lua_next(l, object)) {
+                    if(lua_type(l, -2) == LUA_TSTRING && _snapshot_object(lua_type(l, -1))) {
+                        size_t klen = 0;
+                        const char* k = lua_tolstring(l, -2, &klen);
+                        offer(lua_gettop(l), _snapshot_path(path, '.', k, klen));
+                    }
+                    lua_pop(l, 1);
+                }
+            }
+            lua_pop(l, 1);
+        }
+
+        // Name what was found on this level and explore it next
+        lua_newtable(l);
+        int next = fresh + 1;
+        count = 0;
+        lua_pushnil(l);
+        while(lua_next(l, fresh)) {
+            lua_pop(l, 1);
+            const void* p = lua_type(l, -1) == LUA_TLIGHTUSERDATA ? lua_touserdata(l, -1) : lua_topointer(l, -1);
+            lua_pushvalue(l, -1);
+            lua_pushstring(l, found[p].c_str());
+            lua_rawset(l, names);
+            int type = lua_type(l, -1);
+            if(type == LUA_TTABLE || type == LUA_TUSERDATA) {
+                lua_pushvalue(l, -1);
+                lua_rawseti(l, next, ++count);
+            }
+        }
+        lua_replace(l, frontier);
+        lua_pop(l, 1);
+    }
+    lua_pop(l, 1);
+}
+
+} // namespace detail
+
+/**
+ * Save and load functions for the userdata types an image may
+ * contain, keyed by their registered name.
+ */
+class snapshot_hooks {
+public:
+    struct hook {
+        std::string name;
+        std::function<std::string(lua_State&, int)> save;
+        std::function<void(lua_State&, const std::string&)> load;
+    };
+
+    /**
+     * Add a hook for userdata holding a T (registered with GLUA_REG).
+     * save turns the object into bytes, load makes an equal object
+     * from them, which is pushed by value.
+     */
+    template<typename T>
+    inline void add(std::function<std::string(const T&)> save, std::function<T(const std::string&)> load) {
+        hooks.push_back(hook{
+            ::glua::detail::type_traits<T>::name,
+            [save](lua_State& l, int index) { return save(api::getUserdata<T>(l, index)); },
+            [load](lua_State& l, const std::string& data) { api::push<T>(l, load(data)); }
+        });
+    }
+
+    /**
+     * The hook for the userdata at index, or nullptr.
+     */
+    inline const hook* find(lua_State& l, int index) const {
+        for(const hook& h : hooks) {
+            if(luaL_testudata(&l, index, h.name.c_str()) != nullptr) return &h;
+        }
+        return nullptr;
+    }
+
+    inline const hook* find(const std::string& name) const {
+        for(const hook& h : hooks) {
+            if(h.name == name) return &h;
+        }
+        return nullptr;
+    }
+
+private:
+    std::vector<hook> hooks;
+};
+
+class snapshot {
+public:
+    /**
+     * Record the objects set up natively in l, see above. Call once,
+     * after native setup and before running any script.
+     */
+    static inline void baseline(lua_State& l) {
+        ::glua::detail::_snapshot_names(&l);
+        lua_rawsetp(&l, LUA_REGISTRYINDEX, ::glua::detail::_snapshot_key());
+    }
+
+    /**
+     * Serialize the globals of l and everything reachable from them.
+     * Throws a std::runtime_error naming the type of the first value
+     * that can't be serialized.
+     */
+    static inline std::string capture(lua_State& l, const snapshot_hooks& hooks = snapshot_hooks()) {
+        int base = lua_gettop(&l);
+        lua_rawgetp(&l, LUA_REGISTRYINDEX, ::glua::detail::_snapshot_key());
+        if(lua_type(&l, -1) != LUA_TTABLE) {
+            lua_pop(&l, 1);
+            throw std::runtime_error("Error: snapshot::capture requires snapshot::baseline");
+        }
+        lua_newtable(&l);
+        writer w(l, hooks, base + 1, base + 2);
+        w.out.append(::glua::detail::_snapshot_magic, 8);
+        w.put(::glua::detail::_snapshot_version);
+        w.put(static_cast<uint32_t>(LUA_VERSION_NUM));
+        try {
+            ::glua::detail::_push_globals(&l);
+            w.value(base + 3);
+        } catch(...) {
+            lua_settop(&l, base);
+            throw;
+        }
+        lua_settop(&l, base);
+        return std::move(w.out);
+    }
+
+    /**
+     * Restore an image into l, which must have gone through the same
+     * native setup as the state it was captured from, and nothing
+     * else. The memory needs to stay valid only during the call.
+     */
+    static inline void restore(lua_State& l, const char* data, size_t size,
+                               const snapshot_hooks& hooks = snapshot_hooks())
+    {
+        uint32_t version = 0;
+        uint32_t luaVersion = 0;
+        if(size < 16 || std::memcmp(data, ::glua::detail::_snapshot_magic, 8) != 0) {
+            throw std::runtime_error("Error: not a glua snapshot");
+        }
+        std::memcpy(&version, data + 8, 4);
+        std::memcpy(&luaVersion, data + 12, 4);
+        if(version != ::glua::detail::_snapshot_version) throw std::runtime_error("Error: unsupported glua snapshot version");
+        if(luaVersion != LUA_VERSION_NUM) throw std::runtime_error("Error: glua snapshot is from another lua version");
+
+        int base = lua_gettop(&l);
+        // path -> object
+        ::glua::detail::_snapshot_names(&l);
+        lua_newtable(&l);
+        lua_pushnil(&l);
+        while(lua_next(&l, base + 1)) {
+            lua_pushvalue(&l, -2);
+            lua_rawset(&l, base + 2);
+        }
+        lua_remove(&l, base + 1);
+        lua_newtable(&l);
+        reader r(l, hooks, base + 1, base + 2, data + 16, data + size);
+        try {
+            r.value();
+            if(r.p != r.end) throw std::runtime_error("Error: corrupt glua snapshot");
+        } catch(...) {
+            lua_settop(&l, base);
+            throw;
+        }
+        lua_settop(&l, base);
+    }
+
+    static inline void restore(lua_State& l, const std::string& image, const snapshot_hooks& hooks = snapshot_hooks()) {
+        restore(l, image.data(), image.size(), hooks);
+    }
+
+private:
+    struct writer {
+        writer(lua_State& l, const snapshot_hooks& hooks, int names, int ids)
+        : l(l), hooks(hooks), names(names), ids(ids), next(0) {}
+
+        inline void put(uint8_t v) { out.push_back(static_cast<char>(v)); }
+        inline void put(uint32_t v) { out.append(reinterpret_cast<const char*>(&v), 4); }
+
+        inline void put(const char* s, size_t len) {
+            put(static_cast<uint32_t>(len));
+            out.append(s, len);
+        }
+
+        static int writeChunk(lua_State*, const void* p, size_t sz, void* ud) {
+            static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+            return 0;
+        }
+
+        /**
+         * Write the value at index.
+         */
+        inline void value(int index) {
+            if(!lua_checkstack(&l, 8)) throw std::runtime_error("Error: value nested too deeply to snapshot");
+            int type = lua_type(&l, index);
+            switch(type) {
+            case LUA_TNIL:     put(uint8_t(::glua::detail::_snap_nil)); return;
+            case LUA_TBOOLEAN: put(uint8_t(lua_toboolean(&l, index) ? ::glua::detail::_snap_true : ::glua::detail::_snap_false)); return;
+            case LUA_TNUMBER:
+                if(::glua::detail::_is_integer(&l, index)) {
+                    int64_t i = static_cast<int64_t>(lua_tointeger(&l, index));
+                    put(uint8_t(::glua::detail::_snap_integer));
+                    out.append(reinterpret_cast<const char*>(&i), 8);
+                } else {
+                    double d = static_cast<double>(lua_tonumber(&l, index));
+                    put(uint8_t(::glua::detail::_snap_number));
+                    out.append(reinterpret_cast<const char*>(&d), 8);
+                }
+                return;
+            case LUA_TSTRING: {
+                size_t len = 0;
+                const char* s = lua_tolstring(&l, index, &len);
+                put(uint8_t(::glua::detail::_snap_string));
+                put(s, len);
+                return;
+            }
+            }
+
+            lua_pushvalue(&l, index);
+            lua_rawget(&l, ids);
+            if(!lua_isnil(&l, -1)) {
+                put(uint8_t(::glua::detail::_snap_ref));
+                put(static_cast<uint32_t>(lua_tointeger(&l, -1)));
+                lua_pop(&l, 1);
+                return;
+            }
+            lua_pop(&l, 1);
+            uint32_t id = next++;
+            lua_pushvalue(&l, index);
+            lua_pushinteger(&l, static_cast<lua_Integer>(id));
+            lua_rawset(&l, ids);
+
+            lua_pushvalue(&l, index);
+            lua_rawget(&l, names);
+            bool named = lua_type(&l, -1) == LUA_TSTRING;
+            size_t plen = 0;
+            const char* path = lua_tolstring(&l, -1, &plen);
+            std::string name = named ? std::string(path, plen) : std::string();
+            lua_pop(&l, 1);
+
+            if(type == LUA_TTABLE) {
+                if(named) {
+                    put(uint8_t(::glua::detail::_snap_base_tbl));
+                    put(name.data(), name.size());
+                } else {
+                    put(uint8_t(::glua::detail::_snap_table));
+                }
+                lua_pushnil(&l);
+                while(lua_next(&l, index)) {
+                    int top = lua_gettop(&l);
+                    value(top - 1);
+                    value(top);
+                    lua_pop(&l, 1);
+                }
+                put(uint8_t(::glua::detail::_snap_end));
+                if(lua_getmetatable(&l, index)) {
+                    value(lua_gettop(&l));
+                    lua_pop(&l, 1);
+                } else {
+                    put(uint8_t(::glua::detail::_snap_nil));
+                }
+                return;
+            }
+
+            if(named) {
+                put(uint8_t(::glua::detail::_snap_base));
+                put(name.data(), name.size());
+                return;
+            }
+
+            if(type == LUA_TFUNCTION && !lua_iscfunction(&l, index)) {
+                closure(index, id);
+                return;
+            }
+
+            if(type == LUA_TUSERDATA) {
+                const snapshot_hooks::hook* h = hooks.find(l, index);
+                if(h != nullptr) {
+                    put(uint8_t(::glua::detail::_snap_userdata));
+                    put(h->name.data(), h->name.size());
+                    std::string payload = h->save(l, index);
+                    put(payload.data(), payload.size());
+                    return;
+                }
+            }
+
+            std::string what = type == LUA_TFUNCTION ? "C function" : lua_typename(&l, type);
+            throw std::runtime_error("Error: can't snapshot a " + what + " which isn't in the baseline");
+        }
+
+        /**
+         * Write the lua function at index, numbered id.
+         */
+        inline void closure(int index, uint32_t id) {
+            put(uint8_t(::glua::detail::_snap_function));
+            std::string code;
+            lua_pushvalue(&l, index);
+            ::glua::detail::_dump(&l, &writeChunk, &code, false);
+            lua_pop(&l, 1);
+            auto proto = protos.find(code);
+            if(proto != protos.end()) {
+                put(proto->second);
+            } else {
+                uint32_t n = static_cast<uint32_t>(protos.size());
+                put(n);
+                put(code.data(), code.size());
+                protos.emplace(std::move(code), n);
+            }
+
+            uint32_t nups = 0;
+            while(lua_getupvalue(&l, index, int(nups) + 1) != nullptr) {
+                lua_pop(&l, 1);
+                ++nups;
+            }
+            put(nups);
+            for(int i = 1; i <= int(nups); ++i) {
+                void* uid = lua_upvalueid(&l, index, i);
+                auto shared = upvalues.find(uid);
+                if(shared != upvalues.end()) {
+                    put(uint8_t(::glua::detail::_snap_joined));
+                    put(shared->second.first);
+                    put(static_cast<uint32_t>(shared->second.second));
+                    continue;
+                }
+                upvalues.emplace(uid, std::make_pair(id, i));
+                lua_getupvalue(&l, index, i);
+                value(lua_gettop(&l));
+                lua_pop(&l, 1);
+            }
+        }
+
+        lua_State& l;
+        const snapshot_hooks& hooks;
+        int names;
+        int ids;
+        uint32_t next;
+        std::string out;
+        std::unordered_map<std::string, uint32_t> protos;
+        std::unordered_map<void*, std::pair<uint32_t, int>> upvalues;
+    };
+
+    struct reader {
+        reader(lua_State& l, const snapshot_hooks& hooks, int paths, int objects, const char* p, const char* end)
+        : l(l), hooks(hooks), paths(paths), objects(objects), next(0), p(p), end(end) {}
+
+        inline void need(size_t n) {
+            if(size_t(end - p) < n) throw std::runtime_error("Error: corrupt glua snapshot");
+        }
+
+        inline uint8_t u8() {
+            need(1);
+            return static_cast<uint8_t>(*p++);
+        }
+
+        inline uint32_t u32() {
+            uint32_t v;
+            need(4);
+            std::memcpy(&v, p, 4);
+            p += 4;
+            return v;
+        }
+
+        inline const char* bytes(size_t& len) {
+            len = u32();
+            need(len);
+            const char* s = p;
+            p += len;
+            return s;
+        }
+
+        /**
+         * Push the object numbered id.
+         */
+        inline void registered(uint32_t id) {
+            lua_rawgeti(&l, objects, static_cast<lua_Integer>(id) + 1);
+            if(lua_isnil(&l, -1)) throw std::runtime_error("Error: corrupt glua snapshot");
+        }
+
+        inline void enroll() {
+            lua_pushvalue(&l, -1);
+            lua_rawseti(&l, objects, static_cast<lua_Integer>(next++) + 1);
+        }
+
+        /**
+         * Push the object named path in this state.
+         */
+        inline void base() {
+            size_t len = 0;
+            const char* path = bytes(len);
+            lua_pushlstring(&l, path, len);
+            lua_rawget(&l, paths);
+            if(lua_isnil(&l, -1)) {
+                throw std::runtime_error("Error: snapshot refers to " + std::string(path, len) + ", which this state lacks");
+            }
+        }
+
+        /**
+         * Read a value and push it.
+         */
+        inline void value() {
+            if(!lua_checkstack(&l, 8)) throw std::runtime_error("Error: value nested too deeply to restore");
+            uint8_t tag = u8();
+            switch(tag) {
+            case ::glua::detail::_snap_nil:   lua_pushnil(&l); return;
+            case ::glua::detail::_snap_false: lua_pushboolean(&l, 0); return;
+            case ::glua::detail::_snap_true:  lua_pushboolean(&l, 1); return;
+            case ::glua::detail::_snap_integer: {
+                int64_t i;
+                need(8);
+                std::memcpy(&i, p, 8);
+                p += 8;
+                lua_pushinteger(&l, static_cast<lua_Integer>(i));
+                return;
+            }
+            case ::glua::detail::_snap_number: {
+                double d;
+                need(8);
+                std::memcpy(&d, p, 8);
+                p += 8;
+                lua_pushnumber(&l, static_cast<lua_Number>(d));
+                return;
+            }
+            case ::glua::detail::_snap_string: {
+                size_t len = 0;
+                const char* s = bytes(len);
+                lua_pushlstring(&l, s, len);
+                return;
+            }
+            case ::glua::detail::_snap_ref:
+                registered(u32());
+                return;
+            case ::glua::detail::_snap_base:
+                base();
+                enroll();
+                return;
+            case ::glua::detail::_snap_table:
+            case ::glua::detail::_snap_base_tbl:
+                table(tag == ::glua::detail::_snap_base_tbl);
+                return;
+            case ::glua::detail::_snap_function:
+                closure();
+                return;
+            case ::glua::detail::_snap_userdata: {
+                size_t nlen = 0;
+                const char* name = bytes(nlen);
+                const snapshot_hooks::hook* h = hooks.find(std::string(name, nlen));
+                if(h == nullptr) throw std::runtime_error("Error: no snapshot hook for " + std::string(name, nlen));
+                size_t len = 0;
+                const char* data = bytes(len);
+                h->load(l, std::string(data, len));
+                enroll();
+                return;
+            }
+            }
+            throw std::runtime_error("Error: corrupt glua snapshot");
+        }
+
+        inline void table(bool named) {
+            if(named) {
+                base();
+                if(lua_type(&l, -1) != LUA_TTABLE) throw std::runtime_error("Error: corrupt glua snapshot");
+                // The image has the complete contents
+                lua_pushnil(&l);
+                while(lua_next(&l, -2)) {
+                    lua_pop(&l, 1);
+                    lua_pushvalue(&l, -1);
+                    lua_pushnil(&l);
+                    lua_rawset(&l, -4);
+                }
+            } else {
+                lua_newtable(&l);
+            }
+            enroll();
+            int t = lua_gettop(&l);
+            while(true) {
+                need(1);
+                if(static_cast<uint8_t>(*p) == ::glua::detail::_snap_end) {
+                    ++p;
+                    break;
+                }
+                value();
+                value();
+                if(lua_isnil(&l, -2)) throw std::runtime_error("Error: corrupt glua snapshot");
+                lua_rawset(&l, t);
+            }
+            value();
+            if(lua_type(&l, -1) != LUA_TTABLE && !lua_isnil(&l, -1)) throw std::runtime_error("Error: corrupt glua snapshot");
+            lua_setmetatable(&l, t);
+        }
+
+        inline void closure() {
+            uint32_t proto = u32();
+            if(proto == protos.size()) {
+                size_t len = 0;
+                const char* code = bytes(len);
+                protos.emplace_back(code, len);
+            } else if(proto > protos.size()) {
+                throw std::runtime_error("Error: corrupt glua snapshot");
+            }
+            const std::pair<const char*, size_t>& code = protos[proto];
+            int status = luaL_loadbuffer(&l, code.first, code.second, "=snapshot");
+            if(status != LUA_OK) ::glua::detail::_throw_error(l, status);
+            enroll();
+            int f = lua_gettop(&l);
+
+            uint32_t nups = u32();
+            for(int i = 1; i <= int(nups); ++i) {
+                need(1);
+                if(static_cast<uint8_t>(*p) == ::glua::detail::_snap_joined) {
+                    ++p;
+                    uint32_t id = u32();
+                    int n = static_cast<int>(u32());
+                    registered(id);
+                    if(lua_type(&l, -1) != LUA_TFUNCTION || lua_iscfunction(&l, -1)) {
+                        throw std::runtime_error("Error: corrupt glua snapshot");
+                    }
+                    lua_upvaluejoin(&l, f, i, lua_gettop(&l), n);
+                    lua_pop(&l, 1);
+                    continue;
+                }
+                value();
+                if(lua_setupvalue(&l, f, i) == nullptr) lua_pop(&l, 1);
+            }
+        }
+
+        lua_State& l;
+        const snapshot_hooks& hooks;
+        int paths;
+        int objects;
+        uint32_t next;
+        const char* p;
+        const char* end;
+        std::vector<std::pair<const char*, size_t>> protos;
+    };
+};
+
+} // namespace glua
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <tuple>
+#include <type_traits>
+
+#include "state.hpp"
+#include "function.hpp"
+
+/**
+ * stack.hpp
+ * References to values in stack slots, for values only needed for a
+ * short while. A glua::ref keeps its value in the registry, costing
+ * a luaL_ref and a luaL_unref; a glua::stack_ref costs one push, or
+ * nothing for a value already on the stack such as an argument of a
+ * C function.
+ *
+ * A glua::stack_scope restores the stack top when it goes out of
+ * scope, releasing the slots taken by the stack_refs made within it:
+ *
+ *   glua::stack_scope scope(l);
+ *   glua::stack_function<int(int)> f(s["callback"]);
+ *   int a = f(1), b = f(2);
+ *
+ * A stack_ref is only valid while its slot is, so code using one
+ * must not clear the stack or pop below it. Values which need to
+ * outlive the scope are promoted to a glua::ref or glua::function.
+ *
+ * A selector chain starting at a glua::global resets the stack when
+ * its expression ends, dropping a stack_ref taken from it; take the
+ * global itself (which is kept) or a ref instead.
+ */
+
+namespace glua {
+
+/**
+ * Restores the stack top on destruction.
+ */
+class stack_scope {
+public:
+    explicit stack_scope(lua_State& l) : l(l), top(lua_gettop(&l)) {}
+
+    stack_scope(const stack_scope&) = delete;
+    stack_scope& operator=(const stack_scope&) = delete;
+
+    ~stack_scope() {
+        if(lua_gettop(&l) > top) lua_settop(&l, top);
+    }
+
+private:
+    lua_State& l;
+    int top;
+};
+
+class stack_ref : public selector_base {
+public:
+    /**
+     * Refer to the value at index, which stays where it is.
+     */
+    inline stack_ref(lua_State& l, int index) : selector_base(l), index(lua_absindex(&l, index)) {}
+
+    /**
+     * Push the value of sel into a new slot.
+     */
+    template<typename S, typename std::enable_if<std::is_base_of<selector_base, S>::value>::type* = nullptr>
+    inline explicit stack_ref(S&& sel) : selector_base(sel.l), index(0) {
+        sel.push();
+        index = lua_gettop(&l);
+    }
+
+    /**
+     * Push the value of the global g into a new slot, which g keeps
+     * when it resets the stack.
+     */
+    inline explicit stack_ref(global&& g) : selector_base(g.l), index(0) {
+        g.push();
+        index = lua_gettop(&l);
+        g.base = index;
+    }
+
+    inline stack_ref(const stack_ref& r) : selector_base(r.l), index(r.index) {}
+
+    inline virtual void push() {
+        lua_pushvalue(&l, index);
+    }
+
+    /**
+     * The absolute stack index of the value.
+     */
+    inline int slot() const {
+        return index;
+    }
+
+    inline int type() const {
+        return lua_type(&l, index);
+    }
+
+    /**
+     * A registry reference to the value, which outlives the slot.
+     */
+    inline ref promote() const {
+        return ref(stack_ref(*this));
+    }
+
+protected:
+    int index;
+};
+
+namespace detail {
+
+/**
+ * Call the function pushed at base + 1 with args and convert its
+ * results, then reset the stack to base.
+ */
+template<typename Ret>
+struct _stack_call {
+    template<typename... Args>
+    static inline auto call(lua_State& l, int base, Args&&... args)
+    -> decltype(api::checkGet<Ret>(l))
+    {
+        api::push(l, std::forward<Args>(args)...);
+        api::call(l, sizeof...(Args), 1);
+        decltype(api::checkGet<Ret>(l)) ret = api::checkGet<Ret>(l);
+        lua_settop(&l, base);
+        return ret;
+    }
+};
+
+template<typename... Rets>
+struct _stack_call<std::tuple<Rets...>> {
+    template<typename... Args>
+    static inline auto call(lua_State& l, int base, Args&&... args)
+    -> decltype(api::checkGet<std::tuple<Rets...>>(l))
+    {
+        api::push(l, std::forward<Args>(args)...);
+        api::call(l, sizeof...(Args), sizeof...(Rets));
+        decltype(api::checkGet<std::tuple<Rets...>>(l)) ret = api::checkGet<std::tuple<Rets...>>(l);
+        lua_settop(&l, base);
+        return ret;
+    }
+};
+
+template<>
+struct _stack_call<void> {
+    template<typename... Args>
+    static inline void call(lua_State& l, int base, Args&&... args) {
+        api::push(l, std::forward<Args>(args)...);
+        api::call(l, sizeof...(Args), 0);
+        lua_settop(&l, base);
+    }
+};
+
+} // namespace detail
+
+template<typename FuncType>
+class stack_function {};
+
+/**
+ * A lua function in a stack slot. Calling it leaves the stack as it
+ * was, rather than clearing it.
+ */
+template<typename Ret, typename... Args>
+class stack_function<Ret(Args...)> : public stack_ref {
+public:
+    inline stack_function(lua_State& l, int index) : stack_ref(l, index) {}
+
+    template<typename S, typename std::enable_if<std::is_base_of<selector_base, S>::value>::type* = nullptr>
+    inline explicit stack_function(S&& sel) : stack_ref(std::forward<S>(sel)) {}
+
+    inline explicit stack_function(global&& g) : stack_ref(std::move(g)) {}
+
+    inline stack_function(const stack_function& f) : stack_ref(f) {}
+
+    auto operator()(Args&&... args)
+    -> decltype(detail::_stack_call<Ret>::call(l, 0, std::forward<Args>(args)...))
+    {
+        int base = lua_gettop(&l);
+        this->push();
+        return detail::_stack_call<Ret>::call(l, base, std::forward<Args>(args)...);
+    }
+
+    /**
+     * A glua::function holding a registry reference to the function,
+     * which outlives the slot.
+     */
+    inline function<Ret(Args...)> promote() const {
+        return function<Ret(Args...)>(stack_ref::promote());
+    }
+};
+
+} // namespace glua
@@ -1,24 +1,45 @@
 #pragma once
+#include <memory>
 #include <stdexcept>
 
 #include "api.hpp"
+#include "budget.hpp"
 #include "global.hpp"
+#include "libs.hpp"
 #include "ref.hpp"
 #include "cfunction.hpp"
+#include "gc.hpp"
+#include "memory.hpp"
+#include "overload.hpp"
+#include "profiler.hpp"
 
 namespace glua {
 
 class state {
 public:
-    state(bool openLibs = true) : l(api::open()) {
+    state(bool openLibs = true) : l(api::open(&allocator::alloc, &mem)) {
+        mem.attach(l);
+        detail::_install_handler(l);
         if(openLibs) api::openLibs(l);
     }
 
+    /**
+     * Create a state with only the standard libraries in eager
+     * opened, and those in lazy opened when a script first uses
+     * them, e.g. state(lib::base | lib::string | lib::table, lib::all).
+     */
+    explicit state(lib::mask eager, lib::mask lazy = lib::none) : l(api::open(&allocator::alloc, &mem)) {
+        mem.attach(l);
+        detail::_install_handler(l);
+        api::openLibs(l, eager, lazy);
+    }
+
     // No copying
     state(state&) = delete;
     state& operator=(state&) = delete;
 
     ~state() {
+        prof.reset();
         api::close(l);
     }
 
@@ -30,46 +51,111 @@ public:
     }
 
     /**
-     * Load and run a lua file.
+     * Load and run a lua file. Throws a glua::error if the
+     * file can't be loaded or raises an error.
      */
     inline void load(const char* filename) {
         api::loadFile(l, filename);
     }
 
     /**
-     * Load and run a lua file.
+     * Load and run a lua file. Throws a glua::error if the
+     * file can't be loaded or raises an error.
      */
     inline void load(std::string filename) {
         api::loadFile(l, filename);
     }
 
     /**
-     * Load and run a c-string as a lua chunk.
+     * Load and run a c-string as a lua chunk. Throws a
+     * glua::error if the chunk can't be compiled or raises an error.
      */
     inline void run(const char* chunk) {
         api::loadString(l, chunk);
     }
 
     /**
-     * Load and run a string as a lua chunk.
+     * Load and run a string as a lua chunk. Throws a
+     * glua::error if the chunk can't be compiled or raises an error.
      */
     inline void run(std::string chunk) {
         api::loadString(l, chunk);
     }
 
+    /**
+     * Load and run a c-string as a lua chunk within an execution
+     * budget, throwing budget_exceeded if it runs out.
+     */
+    inline void run(const char* chunk, const budget& b) {
+        api::loadString(l, chunk, b);
+    }
+
     template<typename FuncT, FuncT func>
     void registerFunction(const char* name) {
-        lua_pushcclosure(&l, &cfunction<FuncT, func>::wrapper, 0);
+        lua_pushcclosure(&l, &cfunction<FuncT, func>::wrapper, detail::_push_binding_stats(l, name));
         lua_setglobal(&l, name);
     }
 
     template<typename Functor>
     void registerFunction(const char* name, Functor f) {
-        cfunctor<Functor>::push(l, f);
+        cfunctor<Functor>::push(l, f, name);
+        lua_setglobal(&l, name);
+    }
+
+    /**
+     * Register several functions under one name, each given as
+     * cfunction<decltype(&f), &f>. See overload.hpp for how a call
+     * is matched to a candidate.
+     */
+    template<typename... Candidates>
+    void registerOverloads(const char* name) {
+        lua_pushcclosure(&l, &overload<Candidates...>::wrapper, detail::_push_binding_stats(l, name));
+        lua_setglobal(&l, name);
+    }
+
+    /**
+     * Register several functors under one name.
+     */
+    template<typename... Functors>
+    void registerOverloads(const char* name, Functors... fs) {
+        functor_overload<Functors...>::push(l, std::make_tuple(fs...), name);
         lua_setglobal(&l, name);
     }
+
+    /**
+     * Access the sampling profiler for this state. The profiler
+     * is created on first use and does nothing until started.
+     */
+    inline glua::profiler& profile() {
+        if(!prof) prof.reset(new glua::profiler(l));
+        return *prof;
+    }
+
+    /**
+     * Control garbage collection for this state.
+     */
+    inline gc_control gc() {
+        return gc_control(l);
+    }
+
+    /**
+     * Access memory accounting and limits for this state.
+     */
+    inline allocator& memory() {
+        return mem;
+    }
+
+    /**
+     * The underlying lua_State, for the api functions and for
+     * classes built on it such as glua::environment.
+     */
+    inline lua_State& luaState() {
+        return l;
+    }
 private:
+    allocator mem;
     lua_State& l;
+    std::unique_ptr<glua::profiler> prof;
 };
 
 } // namespace glua
@@ -0,0 +1,26 @@
+#pragma once
+/**
+ * hash.hpp
+ * Hash function used by the on-disk formats (blob, bundle) and by
+ * the change detection of reload.hpp.
+ */
+#include <cstddef>
+#include <cstdint>
+
+namespace glua {
+namespace detail {
+
+/**
+ * 32-bit FNV-1a. Part of the file formats, so it must not change.
+ */
+inline uint32_t _fnv1a(const char* str, size_t len) {
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < len; ++i) {
+        h ^= static_cast<unsigned char>(str[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+} // namespace detail
+} // namespace glua
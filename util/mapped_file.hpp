@@ -0,0 +1,59 @@
+#pragma once
+/**
+ * mapped_file.hpp
+ * Read-only memory mapping of a whole file.
+ */
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace glua {
+namespace detail {
+
+/**
+ * Maps a file read-only and shared, so every process (and every
+ * lua state) reading the same file shares the page cache copy.
+ */
+class _mapped_file {
+public:
+    explicit _mapped_file(const std::string& filename) : ptr(nullptr), len(0) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0) throw std::runtime_error("Error: couldn't open " + filename);
+        struct stat st;
+        if(::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Error: couldn't stat " + filename);
+        }
+        len = static_cast<size_t>(st.st_size);
+        if(len != 0) {
+            void* p = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+            if(p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Error: couldn't map " + filename);
+            }
+            ptr = static_cast<const char*>(p);
+        }
+        ::close(fd);
+    }
+
+    _mapped_file(const _mapped_file&) = delete;
+    _mapped_file& operator=(const _mapped_file&) = delete;
+
+    ~_mapped_file() {
+        if(ptr != nullptr) ::munmap(const_cast<char*>(ptr), len);
+    }
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+
+private:
+    const char* ptr;
+    size_t len;
+};
+
+} // namespace detail
+} // namespace glua
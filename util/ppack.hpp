@@ -2,7 +2,23 @@
 /**
  * ppack.hpp
  * Contains helper structs for dealing with parameter packs.
+ *
+ * From C++14 on _index_list and _build_index_list are built on
+ * std::integer_sequence, which compilers generate with a builtin
+ * instead of one template instantiation per index, and from C++17
+ * on packs are expanded with fold expressions. Define
+ * GLUA_RECURSIVE_TEMPLATES to use the original recursive index
+ * lists and pushes (see _push_n_impl in api.hpp) instead, e.g. to
+ * compare build times.
  */
+#if __cplusplus >= 201402L && !defined(GLUA_RECURSIVE_TEMPLATES)
+#define GLUA_INTEGER_SEQUENCE 1
+#include <utility>
+#endif
+
+#if defined(__cpp_fold_expressions) && !defined(GLUA_RECURSIVE_TEMPLATES)
+#define GLUA_FOLD_EXPRESSIONS 1
+#endif
 
 namespace glua {
 namespace detail {
@@ -40,8 +56,13 @@ struct _first<T> {
  *     std::get<N>(tuple)... // do something with unpacked values here
  * }
  */
+#ifdef GLUA_INTEGER_SEQUENCE
+template<int... N>
+using _index_list = std::integer_sequence<int, N...>;
+#else
 template<int... N>
 struct _index_list {};
+#endif
 
 /**
  * Struct _build_index_list
@@ -52,6 +73,15 @@ struct _index_list {};
  * is equivalent to
  * _index_list<0, 1, 2, . . . N-1>
  */
+#ifdef GLUA_INTEGER_SEQUENCE
+
+template<int N>
+struct _build_index_list {
+    using build = std::make_integer_sequence<int, N>;
+};
+
+#else
+
 template<int... N>
 struct _build_index_list {};
 
@@ -78,6 +108,8 @@ struct _build_index_list<0> {
     using build = _index_list<>;
 };
 
+#endif
+
 /**
  * Struct _index_list_drop_first
  * Helper template to get an _index_list
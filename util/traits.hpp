@@ -1,5 +1,7 @@
 #pragma once 
 
+#include <cstddef>
+
 namespace glua {
 
 template<typename Functor>
@@ -160,6 +162,26 @@ template<typename T>
 struct type_traits {
 };
 
+template<typename E>
+struct _enum_name {
+    E value;
+    const char* name;
+};
+
+/**
+ * Names of the values of the enum E, given with GLUA_ENUM. Enums
+ * without names are passed to lua as their underlying integer.
+ */
+template<typename E>
+struct enum_traits {
+    static constexpr bool named = false;
+
+    static inline const _enum_name<E>* names(size_t& n) {
+        n = 0;
+        return nullptr;
+    }
+};
+
 } // namespace detail
 
 } // namespace glua
@@ -175,3 +197,23 @@ struct type_traits<CLASS> {            \
 }
 
 #define GLUA_REG(CLASS) GLUA_REGISTER(CLASS,CLASS) GLUA_REGISTER(CLASS*,CLASS*)
+
+/**
+ * Pass the enum ENUM to lua as strings, e.g.
+ *   GLUA_ENUM(color, {color::red, "red"}, {color::green, "green"})
+ * Values without a name are still passed as integers.
+ */
+#define GLUA_ENUM(ENUM, ...)                                    \
+namespace glua {                                                \
+namespace detail {                                              \
+template<>                                                      \
+struct enum_traits<ENUM> {                                      \
+    static constexpr bool named = true;                         \
+    static inline const _enum_name<ENUM>* names(size_t& n) {    \
+        static const _enum_name<ENUM> table[] = { __VA_ARGS__ }; \
+        n = sizeof(table) / sizeof(table[0]);                   \
+        return table;                                           \
+    }                                                           \
+};                                                              \
+}                                                               \
+}